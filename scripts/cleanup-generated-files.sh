@@ -1,4 +1,5 @@
 #!/usr/bin/env bash
 
 rm -rf csv csv3 log png svg json *.out
+rm -f moz-perf-x-extract.cache
 rm histogram*.log
@@ -5,12 +5,14 @@
 COMPILEF="-Wall -Wextra -Wfatal-errors -Wno-deprecated-declarations -std=gnu++17 -O2 -g -march=native -pthread -fconcepts"
 
 BASEINCLUDEF="-I/usr/include/boost -I/home/bkoz/src/izzi/src"
-INCLUDEF=$BASEINCLUDEF
+RSVGINCLUDEF=`pkg-config --cflags librsvg-2.0 cairo`
+INCLUDEF="$BASEINCLUDEF $RSVGINCLUDEF"
 
-BASELINKF="-lstdc++fs -lssl -lcrypto"
+BASELINKF="-lstdc++fs -lssl -lcrypto -llzma -lz"
 BOOSTLINKF="-lboost_system -lboost_date_time"
 GEOLINKF="-L/usr/lib64/ -lGeoIP"
-LINKF=$BASELINKF
+RSVGLINKF=`pkg-config --libs librsvg-2.0 cairo`
+LINKF="$BASELINKF $RSVGLINKF"
 
 # The input file to compile, the output filename
 CCFILE=$1
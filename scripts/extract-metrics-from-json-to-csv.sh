@@ -15,11 +15,9 @@ EDITLIST1=$2
 #EDITLIST1="${MOZPERFAX}/data/match-identifier-files/visual-metrics-2021.txt"
 
 # 2, convert json to csv and environment.json files
-MOZXBROWSERTIME=moz-perf-x-extract.browsertime.exe
-for file in json/browsertime*.json
-do
-    $MOZXBDIR/$MOZXBROWSERTIME $file $EDITLIST1
-done
+# All browsertime*.json files in the directory, extracted in parallel.
+MOZXBROWSERTIME=moz-perf-x-extract.exe
+$MOZXBDIR/$MOZXBROWSERTIME json $EDITLIST1
 mkdir csv
 mv *.csv ./csv;
 
@@ -16,7 +16,7 @@ EDITLIST2=$2
 
 
 # 2, convert json to csv and environment.json files
-MOZXBROWSERTIMELOG=moz-perf-x-extract.browsertime_log.exe
+MOZXBROWSERTIMELOG="moz-perf-x-extract.exe --schema=browsertime_log"
 for file in log/browsertime-*.log
 do
     $MOZXBDIR/$MOZXBROWSERTIMELOG $file $EDITLIST2
@@ -19,11 +19,10 @@ fi
 
 # Where to find necessary prequisites.
 MOZXBDIR="${MOZPERFAX}/bin"
-MOZXBROWSERTIME=$MOZXBDIR/moz-perf-x-extract.browsertime.exe
-MOZXDOMAIN=$MOZXBDIR/moz-perf-x-extract.browsertime_url.exe
+MOZXBROWSERTIME=$MOZXBDIR/moz-perf-x-extract.exe
+MOZXINFLUX=$MOZXBDIR/moz-perf-x-export-influx.exe
 
 SCRIPTSDIR="${MOZPERFAX}/scripts"
-SCRIPTCSVTON=$SCRIPTSDIR/csv-index-by-line-and-field.sh
 SCRIPTDEVICE=$SCRIPTSDIR/common-devices.sh
 
 # Convert DEVICEID into something rational and consistent for influx.
@@ -41,43 +40,22 @@ AUTH="Authorization: Token performance_wo:7169686c5ad9119c2557cae47919aff0"
 cd $RDIR
 $SCRIPTSDIR/copy-json-files-to-one-dir.sh
 
-# Required for insertion.
-# DEVICEID
-# PRODUCTID
-# DOMAIN
-# METRIC
-# VALUE
-# VSTDDEV
-# VMDEV
-# DATE/TIMESTAMP
-for file in json/browsertime*.json
+# Extract all json files in one parallel run, with only the specified
+# metrics, to csv files and environment.json files.
+$MOZXBROWSERTIME json $METRICLIST
+mkdir -p csv
+mv *.csv ./csv;
+mv *.environment.json ./json;
+
+# Convert to line protocol, tagged with device, product, and url domain
+# from the environment, in gzipped batches of many points. Then one
+# write per batch.
+BATCHES=`${MOZXINFLUX} csv "${DEVICE}" "${PRODUCTID}" influx-batch ${DATEST}`
+for batch in $BATCHES
 do
-    # Extract minimum domain information
-    DOMAIN=`${MOZXDOMAIN} $file`
-
-    # Make extracted csv file with only the specified metrics...
-    $MOZXBROWSERTIME $file $METRICLIST
-
-    # Find the generated file...
-    csvfilestem=${file%.*}
-    csvstem=${csvfilestem##*/}
-    csvfile="./${csvstem}.?.csv"
-
-    # Get total line count of the file...
-    LC=`cat -n ${csvfile} | tail -n 1 | cut -f1`
-
-    # Extract (LINEN, FIELDN) and insert
-    for ((i=1;i<=${LC}; i++))
-    do
-	METRIC=`${SCRIPTCSVTON} "$csvfile" "$i" 1`
-	VALUE=`${SCRIPTCSVTON} "$csvfile" "$i" 2`
-	VSTDDEV=`${SCRIPTCSVTON} "$csvfile" "$i" 3`
-	VMDEV=`${SCRIPTCSVTON} "$csvfile" "$i" 4`
-
-	DATA="${METRIC},device=${DEVICE},product=${PRODUCTID},url=${DOMAIN} value=${VALUE},stddev=${VSTDDEV},mdev=${VMDEV} ${DATEST}"
-
-	# v2.0
-	echo "${DATA}"
-	curl -i -XPOST "${DB}" --header "${AUTH}" --data-raw "${DATA}"
-    done
+    echo "${batch}"
+    curl -i -XPOST "${DB}" --header "${AUTH}" \
+	 --header "Content-Encoding: gzip" \
+	 --header "Content-Type: text/plain; charset=utf-8" \
+	 --data-binary @"${batch}"
 done
@@ -27,13 +27,9 @@ $SCRIPTSDIR/extract-metrics-from-json-to-csv.sh $RDIR
 CSVDIR=csv3
 #CSVDIR=csv
 
-# 2 convert csv to svg
+# 2 convert csv to svg, all files in one parallel run
 MOZV=moz-perf-x-analyze-radial-uno.exe
-for file in ${RDIR}/${CSVDIR}/*.csv
-do
-    echo $file
-    $MOZXBDIR/$MOZV $file $mcosmo
-done
+$MOZXBDIR/$MOZV ${RDIR}/${CSVDIR} $mcosmo
 
 if [ ! -d ./svg ]; then
     mkdir svg
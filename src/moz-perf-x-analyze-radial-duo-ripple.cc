@@ -99,13 +99,16 @@ int main(int argc, char* argv[])
       svg_element obj = initialize_svg(fstem, width, height);
       const point_2t origin = obj.center_point();
 
-      value_type value_max = largest_value_in(f1, f2);
+      // Load each file once, for both scaling and rendering.
+      const radial_dataset data1(f1);
+      const radial_dataset data2(f2);
+      value_type value_max = largest_value_in(data1, data2);
       clog << "value_max: " << value_max << endl;
 
 #if 0
       // XXXX need imetrictype before hilite
-      render_radial(obj, origin, f1, hilite, value_max, 80, 24);
-      render_radial(obj, origin, f2, hilite, value_max, 320, 24, false);
+      render_radial(obj, origin, data1, hilite, value_max, 80, 24);
+      render_radial(obj, origin, data2, hilite, value_max, 320, 24, false);
 #endif
       clog << "done render" << endl;
 
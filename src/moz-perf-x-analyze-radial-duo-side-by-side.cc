@@ -23,6 +23,7 @@
 #include <unordered_map>
 
 #include "moz-perf-x-radial.h"
+#include "moz-perf-x-thread.h"
 
 
 namespace moz {
@@ -34,6 +35,9 @@ usage()
 		"result-directory1 results-directory2 "
 		"(metric-to-compare-or-highlight)");
   s += '\n';
+  s += "Add --png to also write png files, with --export-dpi=, ";
+  s += "--export-background=, and --export-background-opacity= as for inkscape.";
+  s += '\n';
   return s;
 }
 
@@ -47,6 +51,19 @@ int main(int argc, char* argv[])
    using std::clog;
    using std::endl;
 
+  // Optional png output.
+  raster_options ro;
+  try
+    {
+      ro = strip_raster_flags(argc, argv);
+      parse_raster_color(ro._M_background);
+    }
+  catch (const std::exception& e)
+    {
+      cerr << e.what() << endl << usage() << endl;
+      return 1;
+    }
+
    // Sanity check.
   if (argc != 3 && argc != 4)
     {
@@ -83,6 +100,9 @@ int main(int argc, char* argv[])
 
   const bool scalep = true;
 
+  // Rasterize each svg on the pool, while the next pair renders.
+  task_group rasters(shared_thread_pool());
+
   // For each unique TLD/site in directories, use CSV files to do...
   for (uint i = 0; i < files1.size(); ++i)
     {
@@ -92,6 +112,10 @@ int main(int argc, char* argv[])
       const string fstem = file_path_to_stem(f1) + "-duo-side-by-side";
       svg_element obj = initialize_svg(fstem, width, height);
 
+      // Load each file once, for both scaling and rendering.
+      const radial_dataset data1(f1);
+      const radial_dataset data2(f2);
+
       // Scaling, if desired.
       value_type vmax = 0;
       int radius1 = 80;
@@ -100,8 +124,8 @@ int main(int argc, char* argv[])
       int rspace2 = 24;
       if (scalep)
 	{
-	  value_type max1 = largest_value_in(f1);
-	  value_type max2 = largest_value_in(f2);
+	  value_type max1 = data1._M_max;
+	  value_type max2 = data2._M_max;
 	  if (max1 > max2)
 	    {
 	      double ratio = max1 / max2;
@@ -123,8 +147,8 @@ int main(int argc, char* argv[])
       // Draw arcs.
 #if 0
       // XXX need imetric type before hilite
-      render_radial(obj, point_2t(x1, y), f1, hilite, vmax, radius1, rspace1);
-      render_radial(obj, point_2t(x2, y), f2, hilite, vmax, radius2, rspace2);
+      render_radial(obj, point_2t(x1, y), data1, hilite, vmax, radius1, rspace1);
+      render_radial(obj, point_2t(x2, y), data2, hilite, vmax, radius2, rspace2);
 #endif
 
       // Add metadata.
@@ -140,6 +164,25 @@ int main(int argc, char* argv[])
 	  env = deserialize_environment(f1);
 	}
       render_metadata(obj, env, true);
+
+      if (ro._M_pngp)
+	{
+	  const string ofile = fstem + moz::k::png_ext;
+	  const double w = width;
+	  const double h = height;
+	  rasters.run([svg = svg_document(obj), w, h, ofile, &ro]
+		      { rasterize_svg(svg, w, h, ofile, ro); });
+	}
+    }
+
+  try
+    {
+      rasters.wait();
+    }
+  catch (const std::exception& e)
+    {
+      cerr << e.what() << endl;
+      return 12;
     }
 
   return 0;
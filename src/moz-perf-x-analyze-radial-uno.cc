@@ -23,6 +23,7 @@
 #include <unordered_map>
 
 #include "moz-perf-x-radial.h"
+#include "moz-perf-x-thread.h"
 
 
 namespace moz {
@@ -30,12 +31,57 @@ namespace moz {
 std::string
 usage()
 {
-  std::string s("usage: moz-perf-x-analyze-radial-uno.exe data.csv "
+  std::string s("usage: moz-perf-x-analyze-radial-uno.exe "
+		"[data.csv | csv-directory | metrics.mpxs] "
 		"metric-cosmology (metric-key-to-compare-or-highlight)");
   s += '\n';
+  s += "Add --png to also write png files, rendered in memory, with ";
+  s += "--export-dpi=90, --export-background=white, and ";
+  s += "--export-background-opacity=1.0 as defaults.";
+  s += '\n';
+  s += "Add --svg-stream to write svg as it is made, or --svgz to also ";
+  s += "gzip it, instead of --png.";
+  s += '\n';
+  s += "Add --collision-avoidance to lay out labels so they do not ";
+  s += "overlap, instead of as kusama glyphs.";
+  s += '\n';
   return s;
 }
 
+
+/// Render the latest run of each name in metric store @istore to svg.
+uint
+render_radial_uno_store(const string& istore, const string& imetrictype,
+			const string& hilite, const uno_typography& typos,
+			const raster_options& ro,
+			const svg_stream_options& so, const bool collisionp,
+			thread_pool& pool)
+{
+  const metric_store store(istore);
+  std::vector<uint> runs;
+  for (uint run = 0; run < store.size(); ++run)
+    if (store.find_run(store.run_name(run)) == run)
+      runs.push_back(run);
+
+  std::atomic<uint> nfail(0);
+  parallel_for_each(pool, runs, [&](const uint run)
+  {
+    const string fstem(store.run_name(run));
+    try
+      {
+	const radial_dataset data(store, run, metric_type_scale(imetrictype));
+	render_radial_uno(fstem, data, store.run_environment(run),
+			  imetrictype, hilite, typos, ro, so, collisionp);
+      }
+    catch (const std::exception& e)
+      {
+	std::cerr << k::errorprefix << fstem << ": " << e.what() << std::endl;
+	++nfail;
+      }
+  });
+  return runs.size() - nfail;
+}
+
 } // namespace moz
 
 
@@ -46,6 +92,37 @@ int main(int argc, char* argv[])
    using std::clog;
    using std::endl;
 
+  // Optional png output, rasterized on the render threads, or
+  // streamed svg output.
+  raster_options ro;
+  svg_stream_options so;
+  try
+    {
+      ro = strip_raster_flags(argc, argv);
+      parse_raster_color(ro._M_background);
+      so = strip_svg_stream_flags(argc, argv);
+      if (ro._M_pngp && so._M_streamp)
+	throw std::runtime_error(moz::k::errorprefix
+				 + "--png needs svg in memory, not streamed");
+    }
+  catch (const std::exception& e)
+    {
+      cerr << e.what() << endl << usage() << endl;
+      return 1;
+    }
+
+  // Optional label layout without overlaps.
+  bool collisionp(false);
+  int nargs(1);
+  for (int i = 1; i < argc; ++i)
+    {
+      if (string(argv[i]) == "--collision-avoidance")
+	collisionp = true;
+      else
+	argv[nargs++] = argv[i];
+    }
+  argc = nargs;
+
    // Sanity check.
   if (argc != 3 && argc != 4)
     {
@@ -53,7 +130,7 @@ int main(int argc, char* argv[])
       return 1;
     }
 
-  // Input is CSV file.
+  // Input is CSV file, or directory of CSV files.
   std::string idata = argv[1];
   std::string imetrictype = argv[2];
   clog << "input files: " << idata << endl;
@@ -64,26 +141,61 @@ int main(int argc, char* argv[])
     hilite = argv[3];
   clog << "key metric: " << hilite << endl;
 
-  // Create svg canvas.
+  // Shared render state, read-only from here on.
   init_id_render_state_cache(0.33, hilite);
   set_label_spaces(6);
-  const string fstem = file_path_to_stem(idata);
-  svg_element obj = initialize_svg(fstem);
-  const point_2t origin = obj.center_point();
-  value_type timev = render_radial(obj, origin, idata, imetrictype, hilite);
-
-  // Add metadata.
-  environment env = deserialize_environment(idata);
-  render_metadata(obj, env);
-
-  // Render metadata titles, times, or context.
-  auto x = obj._M_area._M_width / 2;
-  auto y = obj._M_area._M_height - moz::k::margin;
-  render_metadata_time(obj, timev, color::red, x, y);
-
-  value_type tsz = 18;
-  typography typot = make_typography_metadata(tsz, true, color::red);
-  place_text_at_point(obj, typot, hilite, x, y + (2 * tsz));
+  const uno_typography typos = make_uno_typography();
+
+  const string storeext(moz::k::store_ext);
+  const bool storep = idata.size() > storeext.size()
+    && idata.compare(idata.size() - storeext.size(), storeext.size(),
+		     storeext) == 0;
+  try
+    {
+      if (storep)
+	{
+	  // All runs in one mapped store, in parallel.
+	  thread_pool pool;
+	  uint nruns = render_radial_uno_store(idata, imetrictype, hilite,
+					       typos, ro, so, collisionp,
+					       pool);
+	  clog << "rendered " << nruns << " runs" << endl;
+	}
+      else if (filesystem::is_directory(idata))
+	{
+	  // Batch, one svg per csv file, in parallel.
+	  const strings files = populate_files(idata, moz::k::csv_ext);
+	  thread_pool pool;
+	  clog << "rendering " << files.size() << " files with "
+	       << pool.size() << " threads" << endl;
+
+	  std::atomic<uint> nfail(0);
+	  parallel_for_each(pool, files, [&](const string& f)
+	  {
+	    try
+	      {
+		render_radial_uno(f, imetrictype, hilite, typos, ro, so,
+				  collisionp);
+	      }
+	    catch (const std::exception& e)
+	      {
+		cerr << moz::k::errorprefix << f << ": " << e.what() << endl;
+		++nfail;
+	      }
+	  });
+
+	  if (nfail > 0)
+	    cerr << moz::k::errorprefix << nfail << " files failed" << endl;
+	}
+      else
+	render_radial_uno(idata, imetrictype, hilite, typos, ro, so,
+			  collisionp);
+    }
+  catch (const std::exception& e)
+    {
+      cerr << e.what() << endl;
+      return 12;
+    }
 
   return 0;
 }
@@ -0,0 +1,488 @@
+// extraction micro-benchmarks -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include "moz-perf-x-json.h"
+#include "moz-perf-x-log.h"
+#include "moz-perf-x-radial.h"
+
+
+namespace moz {
+
+namespace constants {
+  // Fixture file names, in the fixtures directory if recorded.
+  constexpr const char* bench_main_ping = "bench-main-ping.json";
+  constexpr const char* bench_browsertime = "bench-browsertime.json";
+  constexpr const char* bench_glean_ping = "bench-glean-ping.json";
+  constexpr const char* bench_log = "bench-browsertime.log";
+  constexpr const char* bench_csv = "bench-metrics.csv";
+
+  // Minimum time to repeat each benchmark, in milliseconds.
+  constexpr double bench_min_ms = 500;
+}
+
+
+std::string
+usage()
+{
+  std::string s("usage: moz-perf-x-bench.exe (fixtures-directory)");
+  s += '\n';
+  s += "fixtures-directory has recorded inputs, named as: ";
+  s += string(k::bench_main_ping) + ", " + k::bench_browsertime + ", ";
+  s += string(k::bench_glean_ping) + ", " + k::bench_log + ", ";
+  s += k::bench_csv;
+  s += '\n';
+  s += "missing inputs are generated, as are all without a directory";
+  s += '\n';
+  return s;
+}
+
+
+/// Result of one benchmark: time per iteration, bytes and probes per
+/// iteration.
+struct bench_result
+{
+  string	name;
+  uint		iterations = 0;
+  double	ms = 0;
+  size_t	bytes = 0;
+  size_t	probes = 0;
+};
+
+
+/**
+   Run @fn until at least bench_min_ms have passed, and at least
+   once. The function returns the number of probes it handled, and
+   reads @bytes of input each time.
+*/
+template<typename _Fn>
+bench_result
+run_bench(const string& name, const size_t bytes, _Fn fn)
+{
+  using clock_type = std::chrono::steady_clock;
+  bench_result r;
+  r.name = name;
+  r.bytes = bytes;
+
+  const auto start = clock_type::now();
+  double elapsed(0);
+  while (r.iterations == 0 || elapsed < k::bench_min_ms)
+    {
+      r.probes = fn();
+      ++r.iterations;
+      using ms_type = std::chrono::duration<double, std::milli>;
+      elapsed = ms_type(clock_type::now() - start).count();
+    }
+  r.ms = elapsed / r.iterations;
+  return r;
+}
+
+
+void
+report_bench(const bench_result& r, ostream& os)
+{
+  const double s = r.ms / 1000;
+  const double mbs = s > 0 ? r.bytes / (1024.0 * 1024.0) / s : 0;
+  const double pps = s > 0 ? r.probes / s : 0;
+  os << std::left << std::setw(40) << r.name << std::right
+     << std::setw(8) << r.iterations
+     << std::fixed << std::setprecision(3) << std::setw(12) << r.ms
+     << std::setprecision(1) << std::setw(10) << mbs
+     << std::setprecision(0) << std::setw(14) << pps << k::newline;
+}
+
+
+/// Size of @ifile in bytes, or zero.
+size_t
+file_size(const string& ifile)
+{
+  std::error_code ec;
+  const auto n = filesystem::file_size(ifile, ec);
+  return ec ? 0 : n;
+}
+
+
+/// Name of synthetic probe @i, as in Gecko.
+string
+synthetic_probe_name(const uint i)
+{ return "BENCH_PROBE_" + to_string(i) + "_MS"; }
+
+
+/// Serialize an exponential histogram in Gecko layout, with
+/// @nsamples samples around a random center.
+void
+serialize_synthetic_histogram(ostream& os, std::mt19937& rng,
+			      const uint nsamples)
+{
+  const histogram_layout layout = { histogram_t::exponential, 1, 10000, 50 };
+  const std::vector<int64_t> bounds = histogram_bucket_bounds(layout);
+  std::uniform_int_distribution<uint> center(5, layout.nbuckets - 6);
+  std::binomial_distribution<uint> spread(8, 0.5);
+
+  std::vector<uint> counts(layout.nbuckets, 0);
+  const uint c = center(rng);
+  int64_t sum(0);
+  for (uint i = 0; i < nsamples; ++i)
+    {
+      const uint b = std::min(c + spread(rng) - 4, layout.nbuckets - 1);
+      ++counts[b];
+      sum += bounds[b];
+    }
+
+  os << "{ \"bucket_count\": " << layout.nbuckets
+     << ", \"histogram_type\": " << int(layout.type)
+     << ", \"sum\": " << sum << ", \"range\": [ " << layout.min << ", "
+     << layout.max << " ], \"values\": {";
+  bool firstp = true;
+  for (uint i = 0; i < layout.nbuckets; ++i)
+    {
+      // Zero buckets around the samples, as in Gecko output.
+      const bool edgep = (i > 0 && counts[i - 1] != 0)
+	|| (i + 1 < layout.nbuckets && counts[i + 1] != 0);
+      if (counts[i] != 0 || edgep)
+	{
+	  os << (firstp ? " " : ", ") << k::quote << bounds[i] << "\": "
+	     << counts[i];
+	  firstp = false;
+	}
+    }
+  os << " } }";
+}
+
+
+/// Main ping with @nprobes histograms in the parent process, and as
+/// many in the content process.
+void
+generate_main_ping(const string& ofile, const uint nprobes)
+{
+  std::mt19937 rng(1);
+  std::ofstream ofs(ofile);
+  auto histograms = [&](const uint offset)
+  {
+    ofs << "{" << k::newline;
+    for (uint i = 0; i < nprobes; ++i)
+      {
+	ofs << "  \"" << synthetic_probe_name(offset + i) << "\": ";
+	serialize_synthetic_histogram(ofs, rng, 20 + i % 200);
+	ofs << (i + 1 < nprobes ? "," : "") << k::newline;
+      }
+    ofs << "}";
+  };
+
+  ofs << "{ \"type\": \"main\", \"payload\": { \"histograms\": ";
+  histograms(0);
+  ofs << ", \"processes\": { \"content\": { \"histograms\": ";
+  histograms(nprobes);
+  ofs << " } } } }" << k::newline;
+}
+
+
+/// Glean ping with @nprobes timing distributions, in nanoseconds.
+void
+generate_glean_ping(const string& ofile, const uint nprobes)
+{
+  std::mt19937 rng(2);
+  std::lognormal_distribution<double> ns(16, 1);
+  std::ofstream ofs(ofile);
+  ofs << "{ \"ping_info\": { \"seq\": 1 }, \"metrics\": { "
+      << "\"timing_distribution\": {" << k::newline;
+  for (uint i = 0; i < nprobes; ++i)
+    {
+      ofs << "  \"bench.probe_" << i << "\": { \"sum\": ";
+      std::map<uint64_t, uint> values;
+      uint64_t sum(0);
+      for (uint j = 0; j < 50; ++j)
+	{
+	  const uint64_t v = ns(rng);
+	  sum += v;
+	  ++values[uint64_t(1) << (63 - __builtin_clzll(v | 1))];
+	}
+      ofs << sum << ", \"values\": {";
+      bool firstp = true;
+      for (const auto& [ b, n ] : values)
+	{
+	  ofs << (firstp ? " " : ", ") << k::quote << b << "\": " << n;
+	  firstp = false;
+	}
+      ofs << " } }" << (i + 1 < nprobes ? "," : "") << k::newline;
+    }
+  ofs << "} } }" << k::newline;
+}
+
+
+/// Browsertime results array, with @nurls urls of @nruns runs each.
+void
+generate_browsertime(const string& ofile, const uint nurls, const uint nruns)
+{
+  std::mt19937 rng(3);
+  std::normal_distribution<double> ms(1500, 200);
+  const strings metrics = { "firstPaint", "domContentLoadedTime",
+			    "pageLoadTime", "rumSpeedIndex", "fullyLoaded" };
+  std::ofstream ofs(ofile);
+  ofs << "[" << k::newline;
+  for (uint u = 0; u < nurls; ++u)
+    {
+      ofs << "{ \"info\": { \"url\": \"https://site" << u
+	  << ".example.com/\" }, \"browserScripts\": [" << k::newline;
+      for (uint r = 0; r < nruns; ++r)
+	{
+	  ofs << "  { \"timings\": { ";
+	  for (uint m = 0; m < metrics.size(); ++m)
+	    ofs << (m ? ", " : "") << k::quote << metrics[m] << "\": "
+		<< int(ms(rng));
+	  ofs << " } }" << (r + 1 < nruns ? "," : "") << k::newline;
+	}
+      ofs << "], \"statistics\": { \"timings\": { ";
+      for (uint m = 0; m < metrics.size(); ++m)
+	ofs << (m ? ", " : "") << k::quote << metrics[m]
+	    << "\": { \"median\": " << int(ms(rng)) << ", \"mdev\": "
+	    << int(ms(rng) / 20) << " }";
+      ofs << " } } }" << (u + 1 < nurls ? "," : "") << k::newline;
+    }
+  ofs << "]" << k::newline;
+}
+
+
+/// Browsertime log with @nurls summary lines, between progress lines.
+void
+generate_browsertime_log(const string& ofile, const uint nurls)
+{
+  std::mt19937 rng(4);
+  std::normal_distribution<double> ms(1500, 200);
+  const strings metrics = { "TTFB", "firstPaint", "firstVisualChange", "FCP",
+			    "DOMContentLoaded", "LCP", "Load", "speedIndex",
+			    "perceptualSpeedIndex", "contentfulSpeedIndex",
+			    "visualComplete85", "lastVisualChange" };
+  std::ofstream ofs(ofile);
+  for (uint u = 0; u < nurls; ++u)
+    {
+      for (uint r = 0; r < 20; ++r)
+	ofs << "[2020-07-21 21:15:13] INFO: [browsertime] Testing url "
+	    << "https://site" << u << ".example.com/ iteration " << r
+	    << k::newline;
+      ofs << "[2020-07-21 21:15:13] INFO: [browsertime] https://site" << u
+	  << ".example.com/ 28 requests";
+      for (const string& m : metrics)
+	ofs << ", " << m << ": " << std::fixed << std::setprecision(2)
+	    << ms(rng) / 1000 << "s (±" << ms(rng) / 20 << "ms)";
+      ofs << " (10 runs)" << k::newline;
+    }
+}
+
+
+/// CSV of @nprobes name,value rows.
+void
+generate_csv(const string& ofile, const uint nprobes)
+{
+  std::mt19937 rng(5);
+  std::uniform_int_distribution<uint> v(1, 100000);
+  std::ofstream ofs(ofile);
+  for (uint i = 0; i < nprobes; ++i)
+    ofs << synthetic_probe_name(i) << k::comma << v(rng) << k::newline;
+}
+
+
+/// Edit list file @ofile of @nmatching probe names, then @nmissing
+/// names that match nothing.
+void
+generate_edit_list(const string& ofile, const uint nmatching,
+		   const uint nmissing)
+{
+  std::ofstream ofs(ofile);
+  for (uint i = 0; i < nmatching; ++i)
+    ofs << synthetic_probe_name(i) << k::newline;
+  for (uint i = 0; i < nmissing; ++i)
+    ofs << "BENCH_MISSING_" << i << k::newline;
+}
+
+
+/// Fixture @name in the current directory, copied from @idir if
+/// recorded there, otherwise generated by @genf. Outputs made from
+/// it land next to it.
+template<typename _Fn>
+string
+fixture_file(const string& idir, const string& name, _Fn genf)
+{
+  using filesystem::copy_options;
+  const string ifile(idir + k::pathseparator + name);
+  if (!idir.empty() && filesystem::exists(ifile))
+    {
+      std::clog << "recorded fixture: " << ifile << std::endl;
+      filesystem::copy_file(ifile, name, copy_options::overwrite_existing);
+    }
+  else
+    genf(name);
+  return name;
+}
+
+
+/// Histogram nodes of the main ping: parent, then content process.
+std::vector<const rj::Value*>
+main_ping_histograms(const json_dom& dom)
+{
+  std::vector<const rj::Value*> ret;
+  for (const char* p : { "/payload/histograms",
+			 "/payload/processes/content/histograms" })
+    if (const rj::Value* v = rj::Pointer(p).Get(dom); v && v->IsObject())
+      ret.push_back(v);
+  return ret;
+}
+
+
+/// Run all benchmarks on fixtures from @idir, or generated, and report.
+void
+bench_all(const string& idir, ostream& os)
+{
+  const uint nprobes = 2000;
+  const string mainf = fixture_file(idir, k::bench_main_ping,
+				    [](const string& f)
+				    { generate_main_ping(f, nprobes); });
+  const string btf = fixture_file(idir, k::bench_browsertime,
+				  [](const string& f)
+				  { generate_browsertime(f, 50, 25); });
+  const string gleanf = fixture_file(idir, k::bench_glean_ping,
+				     [](const string& f)
+				     { generate_glean_ping(f, nprobes); });
+  const string logf = fixture_file(idir, k::bench_log,
+				   [](const string& f)
+				   { generate_browsertime_log(f, 200); });
+  const string csvf = fixture_file(idir, k::bench_csv,
+				   [](const string& f)
+				   { generate_csv(f, 20000); });
+
+  // Edit lists: a few names, and every name with many that miss.
+  generate_edit_list("bench-edits-small.txt", 10, 0);
+  generate_edit_list("bench-edits-huge.txt", 2 * nprobes, 10000);
+  const edit_list smalledits("bench-edits-small.txt");
+  const edit_list hugeedits("bench-edits-huge.txt");
+
+  std::vector<bench_result> results;
+
+  // Parse.
+  for (const string& f : { mainf, btf, gleanf })
+    results.push_back(run_bench("parse " + filesystem::path(f).filename().string(),
+				file_size(f), [&f]()
+				{
+				  json_dom dom(deserialize_json_to_dom(f));
+				  return size_t(0);
+				}));
+
+  // Match and extract histograms from one parsed main ping, every
+  // histogram node is one probe looked at.
+  const json_dom maindom(deserialize_json_to_dom(mainf));
+  const auto hnodes = main_ping_histograms(maindom);
+  size_t nhnodes(0);
+  for (const rj::Value* v : hnodes)
+    nhnodes += v->MemberCount();
+
+  auto extract_fields = [&](const edit_list& edits)
+  {
+    return [&]()
+    {
+      probe_matches matches(edits._M_probes);
+      std::ostringstream oss;
+      for (const rj::Value* v : hnodes)
+	extract_histogram_fields<histogram_view_t::median>(*v, matches, oss);
+      return nhnodes;
+    };
+  };
+  results.push_back(run_bench("extract_histogram_fields small edits", 0,
+			      extract_fields(smalledits)));
+  results.push_back(run_bench("extract_histogram_fields huge edits", 0,
+			      extract_fields(hugeedits)));
+
+  auto each_histogram = [&](auto fn)
+  {
+    return [&, fn]()
+    {
+      size_t n(0);
+      for (const rj::Value* v : hnodes)
+	for (vcmem_iterator i = v->MemberBegin(); i != v->MemberEnd(); ++i)
+	  n += !fn(i->value, i->name.GetString()).empty();
+      return n;
+    };
+  };
+  results.push_back(run_bench("extract_histogram_node_median", 0,
+			      each_histogram(extract_histogram_node_median)));
+  results.push_back(run_bench("extract_histogram_node_mean", 0,
+			      each_histogram(extract_histogram_node_mean)));
+
+  // Browsertime log, all url summaries.
+  const size_t logsz = file_size(logf);
+  results.push_back(run_bench("extract_browsertime_log", logsz, [&]()
+			      {
+				extract_browsertime_log(logf, edit_list());
+				return size_t(0);
+			      }));
+
+  // Extracted CSV to radial map.
+  const size_t csvsz = file_size(csvf);
+  results.push_back(run_bench("deserialize_id_value_map", csvsz, [&]()
+			      {
+				std::ifstream ifs(csvf);
+				value_type vmax(0);
+				return deserialize_id_value_map(ifs, vmax).size();
+			      }));
+
+  os << std::left << std::setw(40) << "benchmark" << std::right
+     << std::setw(8) << "iters" << std::setw(12) << "ms/iter"
+     << std::setw(10) << "MB/s" << std::setw(14) << "probes/s" << k::newline;
+  for (const bench_result& r : results)
+    report_bench(r, os);
+}
+
+} // namespace moz
+
+
+int main(int argc, char* argv[])
+{
+  using namespace moz;
+
+  // Sanity check.
+  if (argc > 2)
+    {
+      std::cerr << usage() << std::endl;
+      return 1;
+    }
+  const string idir = argc == 2 ? argv[1] : "";
+
+  try
+    {
+      // Generated fixtures and outputs go in a scratch directory.
+      const auto cwd = filesystem::current_path();
+      const auto wdir = filesystem::temp_directory_path() / "moz-perf-x-bench";
+      filesystem::create_directories(wdir);
+      const string fixtures = idir.empty() ? idir
+	: filesystem::absolute(idir).string();
+      filesystem::current_path(wdir);
+      std::clog << "working directory: " << wdir.string() << std::endl;
+
+      bench_all(fixtures, std::cout);
+      filesystem::current_path(cwd);
+    }
+  catch (const std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 12;
+    }
+
+  return 0;
+}
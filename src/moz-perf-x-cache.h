@@ -0,0 +1,248 @@
+// mozilla incremental extraction cache -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_CACHE_H
+#define moz_X_CACHE_H 1
+
+#include <atomic>
+#include <iostream>
+#include <openssl/evp.h>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+namespace constants {
+  constexpr const char* cache_file = "moz-perf-x-extract.cache";
+
+  // Bump when extraction output changes, to invalidate all entries.
+  constexpr const char* cache_version = "3";
+
+  // Directories the scripts move outputs into, next to where made.
+  constexpr const char* cache_moved_dirs[] = { "csv", "json" };
+}
+
+
+/// SHA-256 of @data, as lower-case hex.
+string
+sha256_hex(std::string_view data)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int nmd(0);
+  if (!EVP_Digest(data.data(), data.size(), md, &nmd, EVP_sha256(), nullptr))
+    throw std::runtime_error(k::errorprefix + "sha256_hex:: digest failed");
+
+  const char* hex = "0123456789abcdef";
+  string ret;
+  for (unsigned int i = 0; i < nmd; ++i)
+    {
+      ret += hex[md[i] >> 4];
+      ret += hex[md[i] & 15];
+    }
+  return ret;
+}
+
+
+/// SHA-256 of the contents of @ifile, or "none" for no file.
+string
+file_sha256_hex(const string& ifile)
+{
+  if (ifile.empty())
+    return "none";
+  const mapped_file mf(ifile);
+  return sha256_hex({ mf.data(), mf.size() });
+}
+
+
+/// Size and modification time of @ifile, as one string, or empty.
+string
+file_stamp(const string& ifile)
+{
+  struct stat st;
+  if (::stat(ifile.c_str(), &st) != 0)
+    return string();
+  return to_string(st.st_size) + k::hypen + to_string(st.st_mtim.tv_sec)
+    + k::hypen + to_string(st.st_mtim.tv_nsec);
+}
+
+
+/**
+   Manifest of past extractions, to skip inputs that have not changed.
+
+   Each entry is an input file, with the hash of its contents, the
+   key for the settings it was extracted with (edit list hash,
+   histogram view, deviations...), and the output files it made with
+   the hash of each. An input is up to date if it and the settings
+   hash the same, and all of its outputs, at least one, are still
+   there with the same hashes. If the input's size and modification
+   time are the same as last time, it is not hashed again.
+
+   The scripts move outputs into csv and json directories right after
+   extraction, so an output is looked for where it was made, and then
+   in those directories next to it. See output_path.
+
+   The manifest is a text file of one entry per line, tab separated:
+   input, stamp, hash, settings, then output and output hash pairs.
+*/
+struct extract_cache
+{
+  struct entry
+  {
+    string	stamp;
+    string	hash;
+    string	settings;
+    strings	outputs;	// output file, hash, output file, hash...
+  };
+
+  const string					_M_file;
+  std::mutex					_M_mutex;
+  std::unordered_map<string, entry>		_M_entries;
+  std::atomic<uint>				_M_nhits;
+
+  explicit
+  extract_cache(const string& ifile = k::cache_file)
+  : _M_file(ifile), _M_nhits(0)
+  {
+    std::ifstream ifs(ifile);
+    string line;
+    while (std::getline(ifs, line))
+      {
+	strings fields;
+	istringstream iss(line);
+	string field;
+	while (std::getline(iss, field, k::tab))
+	  fields.push_back(field);
+	if (fields.size() >= 6 && fields.size() % 2 == 0)
+	  {
+	    entry e = { fields[1], fields[2], fields[3],
+			strings(fields.begin() + 4, fields.end()) };
+	    _M_entries[fields[0]] = std::move(e);
+	  }
+      }
+  }
+
+  extract_cache(const extract_cache&) = delete;
+  extract_cache& operator=(const extract_cache&) = delete;
+
+  /// Settings key, from the edit list file and other settings.
+  static string
+  settings_key(const string& editfile, const string& settings)
+  {
+    return string(k::cache_version) + k::hypen + file_sha256_hex(editfile)
+      + k::hypen + settings;
+  }
+
+  /// Where output @ofile is now: where it was made, or moved into one
+  /// of cache_moved_dirs next to that. Empty if in none of these.
+  static string
+  output_path(const string& ofile)
+  {
+    if (filesystem::exists(ofile))
+      return ofile;
+    const filesystem::path opath(ofile);
+    for (const char* dir : k::cache_moved_dirs)
+      {
+	const filesystem::path moved = opath.parent_path() / dir
+	  / opath.filename();
+	if (filesystem::exists(moved))
+	  return moved.string();
+      }
+    return string();
+  }
+
+  /// Input @ifile is up to date for @settings, so extraction can be
+  /// skipped. Otherwise, returns false and sets @hash for record.
+  bool
+  up_to_date(const string& ifile, const string& settings, string& hash)
+  {
+    entry e;
+    {
+      std::lock_guard<std::mutex> lock(_M_mutex);
+      auto i = _M_entries.find(ifile);
+      if (i == _M_entries.end())
+	{
+	  hash = file_sha256_hex(ifile);
+	  return false;
+	}
+      e = i->second;
+    }
+
+    // Same stamp, same contents.
+    const string stamp = file_stamp(ifile);
+    hash = stamp == e.stamp ? e.hash : file_sha256_hex(ifile);
+    if (hash != e.hash || settings != e.settings || e.outputs.empty())
+      return false;
+
+    for (uint i = 0; i + 1 < e.outputs.size(); i += 2)
+      {
+	const string ofile = output_path(e.outputs[i]);
+	if (ofile.empty() || file_sha256_hex(ofile) != e.outputs[i + 1])
+	  return false;
+      }
+
+    ++_M_nhits;
+    return true;
+  }
+
+  /// Record extraction of @ifile with @hash and @settings into @ofiles.
+  /// Not if there are no outputs: an input that made nothing, or only
+  /// printed, is extracted again next time.
+  void
+  record(const string& ifile, const string& hash, const string& settings,
+	 const strings& ofiles)
+  {
+    if (ofiles.empty())
+      return;
+
+    entry e = { file_stamp(ifile), hash, settings, { } };
+    for (const string& ofile : ofiles)
+      {
+	e.outputs.push_back(ofile);
+	e.outputs.push_back(file_sha256_hex(ofile));
+      }
+
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    _M_entries[ifile] = std::move(e);
+  }
+
+  /// Write manifest, replacing the old one in one step.
+  void
+  save()
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    const string tmpfile(_M_file + ".tmp");
+    {
+      std::ofstream ofs(tmpfile);
+      for (const auto& [ ifile, e ] : _M_entries)
+	{
+	  ofs << ifile << k::tab << e.stamp << k::tab << e.hash
+	      << k::tab << e.settings;
+	  for (const string& s : e.outputs)
+	    ofs << k::tab << s;
+	  ofs << k::newline;
+	}
+      if (!ofs.good())
+	throw std::runtime_error(k::errorprefix + "extract_cache:: write "
+				 + tmpfile);
+    }
+    filesystem::rename(tmpfile, _M_file);
+  }
+};
+
+} // namespace moz
+#endif
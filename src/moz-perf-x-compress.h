@@ -0,0 +1,473 @@
+// mozilla compressed input files -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_COMPRESS_H
+#define moz_X_COMPRESS_H 1
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+/**
+   Decompression of input files, in memory.
+
+   mozLz4: Firefox profile files like sessionstore.jsonlz4, which are
+   one LZ4 block behind a header of the magic "mozLz40\0" and the
+   decompressed size as a little-endian uint32. Same as mozlz4a.py.
+
+   xz: browsertime results, as .json.xz or .tar.xz archives. Uses
+   liblzma, link with -llzma.
+
+   gzip: compression of generated output, with zlib, link with -lz.
+
+   Decompressed buffers always end in a null byte, not counted in the
+   contents, so that they can be parsed in place as a C string.
+*/
+
+namespace constants {
+  constexpr const char mozlz4_magic[] = "mozLz40";		// + '\0'
+  constexpr const char xz_magic[] = "\xFD" "7zXZ";		// + '\0'
+  constexpr const char* tarxz_ext = ".tar.xz";
+}
+
+
+bool
+mozlz4_p(const char* data, const size_t n)
+{
+  const size_t nmagic = sizeof(k::mozlz4_magic);
+  return n >= nmagic + 4 && std::memcmp(data, k::mozlz4_magic, nmagic) == 0;
+}
+
+
+bool
+xz_p(const char* data, const size_t n)
+{
+  const size_t nmagic = sizeof(k::xz_magic);
+  return n >= nmagic && std::memcmp(data, k::xz_magic, nmagic) == 0;
+}
+
+
+bool
+tarxz_p(const string& ifile)
+{
+  const string ext(k::tarxz_ext);
+  return ifile.size() > ext.size()
+    && ifile.compare(ifile.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+
+/// Decompress mozLz4 file contents, LZ4 block format.
+std::vector<char>
+decompress_mozlz4(const char* data, const size_t n)
+{
+  auto fail = [](const string& m)
+  { throw std::runtime_error(k::errorprefix + "decompress_mozlz4:: " + m); };
+
+  if (!mozlz4_p(data, n))
+    fail("no mozLz40 header");
+
+  const uint8_t* ip = reinterpret_cast<const uint8_t*>(data);
+  const uint8_t* iend = ip + n;
+  ip += sizeof(k::mozlz4_magic);
+  const size_t osize = ip[0] | (ip[1] << 8) | (ip[2] << 16)
+		       | (size_t(ip[3]) << 24);
+  ip += 4;
+
+  std::vector<char> out(osize + 1, '\0');
+  char* const ostart = out.data();
+  char* op = ostart;
+  char* const oend = ostart + osize;
+
+  // Extra length, as a run of bytes added up until one is not 255.
+  auto length = [&](size_t len)
+  {
+    uint8_t b;
+    do
+      {
+	if (ip == iend)
+	  fail("truncated length");
+	b = *ip++;
+	len += b;
+      }
+    while (b == 255);
+    return len;
+  };
+
+  while (ip < iend)
+    {
+      // Sequence token, high nibble literal length, low match length.
+      const uint8_t token = *ip++;
+      size_t nlit = token >> 4;
+      if (nlit == 15)
+	nlit = length(nlit);
+      if (nlit > size_t(iend - ip) || nlit > size_t(oend - op))
+	fail("literal out of bounds");
+      std::memcpy(op, ip, nlit);
+      ip += nlit;
+      op += nlit;
+
+      // Last sequence is literals only.
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	fail("truncated offset");
+      const size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > size_t(op - ostart))
+	fail("match offset out of bounds");
+
+      size_t nmatch = token & 15;
+      if (nmatch == 15)
+	nmatch = length(nmatch);
+      nmatch += 4;
+      if (nmatch > size_t(oend - op))
+	fail("match out of bounds");
+
+      // Match may overlap output, so copy forward byte by byte.
+      const char* mp = op - offset;
+      for (size_t i = 0; i < nmatch; ++i)
+	*op++ = *mp++;
+    }
+
+  if (op != oend)
+    fail("decompressed size mismatch");
+  return out;
+}
+
+
+/// Incremental xz decompression of file contents already in memory.
+struct xz_reader
+{
+  lzma_stream	_M_strm;
+  bool		_M_end;
+
+  xz_reader(const char* data, const size_t n)
+  : _M_strm(LZMA_STREAM_INIT), _M_end(false)
+  {
+    const uint32_t flags = LZMA_CONCATENATED;
+    if (lzma_stream_decoder(&_M_strm, UINT64_MAX, flags) != LZMA_OK)
+      throw std::runtime_error(k::errorprefix + "xz_reader:: decoder init");
+    _M_strm.next_in = reinterpret_cast<const uint8_t*>(data);
+    _M_strm.avail_in = n;
+  }
+
+  xz_reader(const xz_reader&) = delete;
+  xz_reader& operator=(const xz_reader&) = delete;
+
+  ~xz_reader()
+  { lzma_end(&_M_strm); }
+
+  /// Decompress up to @n bytes into @out. Returns bytes written, which
+  /// is less than @n only at the end of the stream.
+  size_t
+  read(char* out, const size_t n)
+  {
+    _M_strm.next_out = reinterpret_cast<uint8_t*>(out);
+    _M_strm.avail_out = n;
+    while (_M_strm.avail_out > 0 && !_M_end)
+      {
+	lzma_ret ret = lzma_code(&_M_strm, LZMA_FINISH);
+	if (ret == LZMA_STREAM_END)
+	  _M_end = true;
+	else if (ret != LZMA_OK)
+	  {
+	    string m(k::errorprefix + "xz_reader:: decode error ");
+	    m += to_string(ret);
+	    throw std::runtime_error(m);
+	  }
+      }
+    return n - _M_strm.avail_out;
+  }
+
+  /// Skip @n bytes of output.
+  bool
+  skip(size_t n)
+  {
+    char scratch[4096];
+    while (n > 0)
+      {
+	const size_t nread = std::min(n, sizeof(scratch));
+	if (read(scratch, nread) != nread)
+	  return false;
+	n -= nread;
+      }
+    return true;
+  }
+};
+
+
+/// Decompress xz file contents, all at once.
+std::vector<char>
+decompress_xz(const char* data, const size_t n)
+{
+  xz_reader xz(data, n);
+  std::vector<char> out;
+  size_t nout(0);
+  size_t nread(0);
+  do
+    {
+      out.resize(std::max(nout * 2, n * 4 + 4096));
+      nread = xz.read(out.data() + nout, out.size() - nout);
+      nout += nread;
+    }
+  while (nout == out.size());
+  out.resize(nout);
+  out.push_back('\0');
+  return out;
+}
+
+
+/// Compress @data to gzip format, all at once.
+string
+compress_gzip(std::string_view data, const int level = Z_DEFAULT_COMPRESSION)
+{
+  z_stream zs = { };
+  const int gzipbits = 15 + 16;
+  if (deflateInit2(&zs, level, Z_DEFLATED, gzipbits, 8, Z_DEFAULT_STRATEGY)
+      != Z_OK)
+    throw std::runtime_error(k::errorprefix + "compress_gzip:: init");
+
+  string out(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef*>(out.data());
+  zs.avail_out = out.size();
+  const int ret = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+
+  if (ret != Z_STREAM_END)
+    throw std::runtime_error(k::errorprefix + "compress_gzip:: deflate");
+  return out;
+}
+
+
+/**
+   Output file @ofile written through a fixed-size buffer of @capacity
+   bytes, and gzip compressed on the way if @gzipp. Memory use is the
+   buffer and the zlib state, however much is written.
+*/
+struct buffered_file_sink
+{
+  const string		_M_file;
+  const bool		_M_gzipp;
+  std::ofstream		_M_ofs;
+  std::vector<char>	_M_buffer;
+  size_t		_M_size;
+  z_stream		_M_zs;
+  std::vector<char>	_M_zbuffer;
+  bool			_M_closedp;
+
+  buffered_file_sink(const string& ofile, const bool gzipp,
+		     const size_t capacity = 64 * 1024)
+  : _M_file(ofile), _M_gzipp(gzipp), _M_ofs(ofile, std::ios::binary),
+    _M_buffer(std::max(capacity, size_t(1))), _M_size(0), _M_zs(),
+    _M_closedp(false)
+  {
+    if (!_M_ofs.good())
+      throw std::runtime_error(k::errorprefix + "buffered_file_sink:: "
+			       + "cannot open " + ofile);
+    if (_M_gzipp)
+      {
+	const int gzipbits = 15 + 16;
+	if (deflateInit2(&_M_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzipbits,
+			 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	  throw std::runtime_error(k::errorprefix + "buffered_file_sink:: "
+				   + "init");
+	_M_zbuffer.resize(_M_buffer.size());
+      }
+  }
+
+  buffered_file_sink(const buffered_file_sink&) = delete;
+  buffered_file_sink& operator=(const buffered_file_sink&) = delete;
+
+  ~buffered_file_sink()
+  {
+    try
+      {
+	close();
+      }
+    catch (const std::exception& e)
+      {
+	std::cerr << e.what() << std::endl;
+      }
+  }
+
+  void
+  write(std::string_view s)
+  {
+    while (!s.empty())
+      {
+	const size_t n = std::min(s.size(), _M_buffer.size() - _M_size);
+	std::memcpy(_M_buffer.data() + _M_size, s.data(), n);
+	_M_size += n;
+	s.remove_prefix(n);
+	if (_M_size == _M_buffer.size())
+	  flush_buffer(Z_NO_FLUSH);
+      }
+  }
+
+  /// Write what is buffered, end the gzip stream, and close.
+  void
+  close()
+  {
+    if (_M_closedp)
+      return;
+    _M_closedp = true;
+    flush_buffer(Z_FINISH);
+    if (_M_gzipp)
+      deflateEnd(&_M_zs);
+    _M_ofs.close();
+    if (_M_ofs.fail())
+      throw std::runtime_error(k::errorprefix + "buffered_file_sink:: "
+			       + "cannot write " + _M_file);
+  }
+
+private:
+  void
+  flush_buffer(const int flush)
+  {
+    if (!_M_gzipp)
+      {
+	_M_ofs.write(_M_buffer.data(), _M_size);
+	_M_size = 0;
+	return;
+      }
+
+    _M_zs.next_in = reinterpret_cast<Bytef*>(_M_buffer.data());
+    _M_zs.avail_in = _M_size;
+    int ret(Z_OK);
+    do
+      {
+	_M_zs.next_out = reinterpret_cast<Bytef*>(_M_zbuffer.data());
+	_M_zs.avail_out = _M_zbuffer.size();
+	ret = deflate(&_M_zs, flush);
+	if (ret == Z_STREAM_ERROR)
+	  throw std::runtime_error(k::errorprefix + "buffered_file_sink:: "
+				   + "deflate");
+	_M_ofs.write(_M_zbuffer.data(), _M_zbuffer.size() - _M_zs.avail_out);
+      }
+    while (flush == Z_FINISH ? ret != Z_STREAM_END : _M_zs.avail_out == 0);
+    _M_size = 0;
+  }
+};
+
+
+/// Numeric tar header field, octal or GNU base-256.
+size_t
+tar_header_number(const char* field, const size_t n)
+{
+  size_t ret(0);
+  const uint8_t* f = reinterpret_cast<const uint8_t*>(field);
+  if (f[0] & 0x80)
+    {
+      for (size_t i = 1; i < n; ++i)
+	ret = (ret << 8) | f[i];
+    }
+  else
+    {
+      for (size_t i = 0; i < n && f[i] >= '0' && f[i] <= '7'; ++i)
+	ret = (ret << 3) | (f[i] - '0');
+    }
+  return ret;
+}
+
+
+/**
+   Read the tar archive in xz stream @xz one member at a time. For
+   each regular file member whose name satisfies @wantp, decompress
+   its contents into a buffer (ending in a null byte), and pass that
+   to @fn as fn(name, buffer). Other members are skipped.
+*/
+template<typename _Pred, typename _Fn>
+void
+for_each_tar_member(xz_reader& xz, _Pred wantp, _Fn fn)
+{
+  const size_t block = 512;
+  char header[block];
+  string longname;
+  while (xz.read(header, block) == block)
+    {
+      // End of archive is zero blocks.
+      if (std::all_of(header, header + block, [](char c) { return c == 0; }))
+	break;
+
+      string name(header, strnlen(header, 100));
+      const bool ustarp = std::memcmp(header + 257, "ustar", 5) == 0;
+      if (ustarp && header[345])
+	name = string(header + 345, strnlen(header + 345, 155)) + '/' + name;
+      if (!longname.empty())
+	name = std::exchange(longname, string());
+
+      const size_t size = tar_header_number(header + 124, 12);
+      const size_t padding = (block - size % block) % block;
+      const char type = header[156];
+
+      bool okp = true;
+      if (type == 'L')
+	{
+	  // GNU long name for the next member.
+	  longname.resize(size);
+	  okp = xz.read(longname.data(), size) == size && xz.skip(padding);
+	  longname.resize(strnlen(longname.data(), size));
+	}
+      else if (type == 'x')
+	{
+	  // POSIX pax extended header, records of "len key=value\n".
+	  string records(size, '\0');
+	  okp = xz.read(records.data(), size) == size && xz.skip(padding);
+	  const string key(" path=");
+	  size_t pos(0);
+	  while (okp && pos < records.size())
+	    {
+	      const size_t len = std::strtoul(records.c_str() + pos, nullptr, 10);
+	      if (len == 0 || pos + len > records.size())
+		break;
+	      const string record(records, pos, len - 1);
+	      const size_t kpos = record.find(key);
+	      if (kpos != string::npos && record.find(' ') == kpos)
+		longname = record.substr(kpos + key.size());
+	      pos += len;
+	    }
+	}
+      else if ((type == '0' || type == '\0') && wantp(name))
+	{
+	  std::vector<char> buffer(size + 1, '\0');
+	  okp = xz.read(buffer.data(), size) == size && xz.skip(padding);
+	  if (okp)
+	    fn(name, buffer);
+	}
+      else
+	okp = xz.skip(size + padding);
+
+      if (!okp)
+	throw std::runtime_error(k::errorprefix + "tar archive truncated");
+    }
+}
+
+} // namespace moz
+#endif
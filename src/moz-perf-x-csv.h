@@ -0,0 +1,131 @@
+// mozilla extracted CSV files -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_CSV_H
+#define moz_X_CSV_H 1
+
+#include <algorithm>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+/**
+   CSV files as written by extraction, one metric per line as
+
+   name,value
+   name,value,stddev
+   name,value,stddev,mdev
+
+   Files are memory mapped and tokenized in place with from_chars, so
+   reading does no per-row allocation: names are string_views into
+   the mapping, and are only valid as long as the csv_file is.
+*/
+struct csv_row
+{
+  std::string_view	name;
+  double		value = 0;
+  double		stddev = 0;
+  double		mdev = 0;
+  uint			nfields = 0;
+};
+
+using csv_rows = std::vector<csv_row>;
+
+
+/// Parse number in [first, last), ignoring leading spaces.
+/// Returns zero if there is no number.
+double
+parse_csv_number(const char* first, const char* last)
+{
+  while (first != last && *first == k::space)
+    ++first;
+  double d(0);
+  if (std::from_chars(first, last, d).ec != std::errc())
+    d = 0;
+  return d;
+}
+
+
+/// Parse line [first, last), without the newline, into @row.
+/// Returns false for lines without both a name and a value.
+bool
+parse_csv_line(const char* first, const char* last, csv_row& row)
+{
+  if (first != last && last[-1] == '\r')
+    --last;
+
+  const char* comma = std::find(first, last, k::comma);
+  row = csv_row();
+  row.name = std::string_view(first, comma - first);
+  row.nfields = 1;
+  double* fields[] = { &row.value, &row.stddev, &row.mdev };
+  for (double* f : fields)
+    {
+      if (comma == last)
+	break;
+      const char* start = comma + 1;
+      comma = std::find(start, last, k::comma);
+      *f = parse_csv_number(start, comma);
+      ++row.nfields;
+    }
+  return !row.name.empty() && row.nfields >= 2;
+}
+
+
+/// Parse all lines of @data.
+csv_rows
+parse_csv(std::string_view data)
+{
+  csv_rows rows;
+  rows.reserve(std::count(data.begin(), data.end(), k::newline) + 1);
+
+  const char* first = data.data();
+  const char* const end = first + data.size();
+  while (first != end)
+    {
+      const char* last = std::find(first, end, k::newline);
+      csv_row row;
+      if (parse_csv_line(first, last, row))
+	rows.push_back(row);
+      first = last == end ? end : last + 1;
+    }
+  return rows;
+}
+
+
+/// Memory mapped CSV file and its rows.
+struct csv_file
+{
+  mapped_file	_M_file;
+  csv_rows	_M_rows;
+
+  explicit
+  csv_file(const string& ifile)
+  : _M_file(ifile), _M_rows(parse_csv({ _M_file.data(), _M_file.size() }))
+  { }
+
+  csv_file(csv_file&&) = default;
+
+  const csv_rows&
+  rows() const
+  { return _M_rows; }
+};
+
+} // namespace moz
+#endif
@@ -0,0 +1,129 @@
+// telemetry export to InfluxDB -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#include <iostream>
+#include <algorithm>
+
+#include "moz-perf-x-json.h"
+#include "moz-perf-x-influx.h"
+
+
+namespace moz {
+
+std::string
+usage()
+{
+  std::string s("usage: moz-perf-x-export-influx.exe "
+		"csv-directory device product [output-stem | -] "
+		"(timestamp-seconds)");
+  s += '\n';
+  s += "csv-directory is extracted browsertime csv files, ";
+  s += "with environment.json files in the sibling json directory";
+  s += '\n';
+  return s;
+}
+
+
+/**
+   Export all extracted csv @files to @sink, tagged with @device,
+   @product, and the url domain from the matching environment. The
+   timestamp is @timestamp if not zero, otherwise from the environment.
+   Returns the number of files exported.
+*/
+uint
+export_influx(const strings& files, const string& device,
+	      const string& product, const int64_t timestamp,
+	      influx_sink& sink)
+{
+  uint nfiles(0);
+  for (const string& f : files)
+    {
+      influx_tags tags = { device, product, "" };
+      int64_t ts = timestamp;
+      try
+	{
+	  environment env = deserialize_environment(f);
+	  tags.url = url_to_domain(env.url);
+	  if (ts == 0)
+	    ts = iso_timestamp_to_seconds(env.date_time_stamp);
+	}
+      catch (const std::exception& e)
+	{
+	  std::cerr << k::errorprefix << f << ": " << e.what() << std::endl;
+	}
+
+      if (ts == 0)
+	{
+	  std::cerr << k::errorprefix << f << ": no timestamp, skipping"
+		    << std::endl;
+	  continue;
+	}
+
+      const csv_file csv(f);
+      for (const csv_row& row : csv.rows())
+	sink.add(row, tags, ts);
+      ++nfiles;
+    }
+  sink.flush();
+  return nfiles;
+}
+
+} // namespace moz
+
+
+int main(int argc, char* argv[])
+{
+  using namespace moz;
+
+  // Sanity check.
+  if (argc != 5 && argc != 6)
+    {
+      std::cerr << usage() << std::endl;
+      return 1;
+    }
+
+  const string idir = argv[1];
+  const string device = argv[2];
+  const string product = argv[3];
+  const string ofstem = argv[4];
+  int64_t timestamp(0);
+  if (argc == 6)
+    timestamp = std::stoll(argv[5]);
+
+  // Line protocol points per write, gzip compressed.
+  const size_t batch_points = 5000;
+  const bool gzipp = true;
+
+  try
+    {
+      const strings files = populate_files(idir, k::csv_ext);
+      influx_sink sink(ofstem, batch_points, gzipp);
+      uint nfiles = export_influx(files, device, product, timestamp, sink);
+      std::clog << "exported " << sink._M_ntotal << " points from "
+		<< nfiles << " files in " << sink._M_files.size()
+		<< " batches" << std::endl;
+      for (const string& f : sink._M_files)
+	std::cout << f << std::endl;
+    }
+  catch (const std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 12;
+    }
+
+  return 0;
+}
@@ -16,10 +16,17 @@
 // General Public License for more details.
 
 #include <chrono>
+#include <csignal>
 #include <iostream>
 #include <algorithm>
 
 #include "moz-perf-x-radial.h"
+#include "moz-perf-x-json-stream.h"
+#include "moz-perf-x-log.h"
+#include "moz-perf-x-thread.h"
+#include "moz-perf-x-store.h"
+#include "moz-perf-x-cache.h"
+#include "moz-perf-x-watch.h"
 
 
 namespace moz {
@@ -27,7 +34,31 @@ namespace moz {
 std::string
 usage()
 {
-  std::string s("usage: moz-telemetry-x-extract.exe data.json (names.txt)");
+  std::string s("usage: moz-telemetry-x-extract.exe "
+		"[data.json | data.tar.xz | data-directory] (names.txt) "
+		"(metrics.mpxs)");
+  s += '\n';
+  s += "       moz-telemetry-x-extract.exe --watch results-directory "
+    "names.txt metric-cosmology (metric-key-to-highlight)";
+  s += '\n';
+  s += "       moz-telemetry-x-extract.exe --aggregate [ping.json | "
+    "ping-directory] names.txt (output-stem)";
+  s += '\n';
+  s += "Add --schema=name for input other than browsertime JSON: ";
+  s += "browsertime_log, browsertime_url, mozilla_desktop, mozilla_android, ";
+  s += "or mozilla_glean.";
+  s += '\n';
+  s += "Add --view=name for histograms as other than the default, ";
+  s += "median (sum for mozilla_android): sum, median, mean, quantile, ";
+  s += "range, stddev, or mdev. Browsertime has median and mean only.";
+  s += '\n';
+  s += "Add --quantile=p, from 0 to 1, for the quantile view as other ";
+  s += "than p95: 0.5, 0.75, 0.99...";
+  s += '\n';
+  s += "Add --stats=file.json for time and counters per stage, or ";
+  s += "--trace=file.json for a Chrome trace.";
+  s += '\n';
+  s += "Add --no-cache to extract every input, even if unchanged.";
   return s;
 }
 
@@ -53,135 +84,163 @@ namespace constants {
 }
 
 
-strings
-remove_matches(const strings& total, const strings& found)
+// Log accounting of found, to-find, after @nfound more are found.
+void
+update_matches(const uint nfound, const probe_matches& matches)
 {
-  // Update accounting of found, to-find.
-  strings remaining;
-
-  if (found.empty())
-    remaining = total;
-  else
+  if (nfound > 0)
     {
-      std::set_difference(total.begin(), total.end(),
-			  found.begin(), found.end(),
-			  std::inserter(remaining, remaining.begin()));
-
-      std::clog << "probes total: " << total.size() << std::endl;
-      std::clog << "probes found: " << found.size() << std::endl;
-      std::clog << "probes remaining: " << remaining.size() << std::endl;
+      std::clog << "probes total: " << matches.remain_size() + nfound
+		<< std::endl;
+      std::clog << "probes found: " << nfound << std::endl;
+      std::clog << "probes remaining: " << matches.remain_size() << std::endl;
       std::clog << std::endl;
     }
-
-  return remaining;
 }
 
 
-void
-update_matches(const strings& nfound, strings& tremain, strings& tfound)
+/// Histogram or scalar node of a ping, extracted in turn.
+struct probe_subtree
 {
-  std::copy(nfound.begin(), nfound.end(), std::back_inserter(tfound));
-  tremain = remove_matches(tremain, nfound);
-}
+  const rj::Value*	node;
+  bool			histogramp;
+};
+
+using probe_subtrees = std::vector<probe_subtree>;
 
 
+/// Add histogram node @dhisto and its process sub-nodes to @trees.
 void
-extract_histogram_nodes(const rj::Value& dnode, strings& found, strings& remain,
-		       ostream& ofs, histogram_view_t hvw)
+collect_histogram_subtrees(const rj::Value& dhisto, probe_subtrees& trees)
 {
-  const strings& dfound = extract_histogram_fields(dnode, remain, ofs, hvw);
-  update_matches(dfound, remain, found);
+  trees.push_back({ &dhisto, true });
+  if (!dhisto.IsObject())
+    return;
+
+  const char* processes[] = { k::content, k::parent, k::extension,
+			      k::dynamic, k::gpu, k::socket };
+  for (const char* process : processes)
+    if (dhisto.HasMember(process))
+      trees.push_back({ &dhisto[process], true });
 }
 
 
+/// Add scalar node @dscal and its process sub-nodes to @trees.
 void
-extract_scalar_nodes(const rj::Value& dnode, strings& found, strings& remain,
-		       ostream& ofs)
+collect_scalar_subtrees(const rj::Value& dscal, probe_subtrees& trees)
 {
-  const strings& dfound = extract_scalar_fields(dnode, remain, ofs);
-  update_matches(dfound, remain, found);
+  trees.push_back({ &dscal, false });
+  if (!dscal.IsObject())
+    return;
+
+  const char* processes[] = { k::content, k::parent };
+  for (const char* process : processes)
+    if (dscal.HasMember(process))
+      trees.push_back({ &dscal[process], false });
 }
 
 
-
-// Histogram node and sub-nodes.
+/**
+   Extract @trees one after another, as the nodes were extracted
+   before: a probe is taken from the first node that has it, and is
+   not extracted again from later nodes.
+
+   Within one node, the probes not yet found are split into runs that
+   are extracted in parallel. Each run buffers its sanity check log
+   lines, and runs are merged in member order, so the rows, the logs,
+   and their order are the same as extracting the node in one go.
+*/
+template<histogram_view_t _View>
 void
-extract_histograms_mozilla(const rj::Value& dhisto,
-			   strings& found, strings& remain,
-			   ostream& ofs, histogram_view_t hvw)
+extract_probe_subtrees(const probe_subtrees& trees, probe_matches& matches,
+		       ostream& ofs)
 {
-  // Extract histogram values.
-  extract_histogram_nodes(dhisto, found, remain, ofs, hvw);
+  scoped_timer timer("match_probes");
+  timer.count("nodes", trees.size());
 
-  if (dhisto.HasMember(k::content))
-    {
-      std::clog << k::content << std::endl;
-      const rj::Value& dcontent = dhisto[k::content];
-      extract_histogram_nodes(dcontent, found, remain, ofs, hvw);
-    }
+  // Fewest probes in one task, under which splitting costs more.
+  constexpr uint grain = 32;
 
-  if (dhisto.HasMember(k::parent))
+  thread_pool& pool = shared_thread_pool();
+  const probe_index& probes = matches._M_index;
+  uint nmatched(0);
+  for (const probe_subtree& tree : trees)
     {
-      std::clog << k::parent << std::endl;
-      const rj::Value& dparent = dhisto[k::parent];
-      extract_histogram_nodes(dparent, found, remain, ofs, hvw);
-    }
+      const id_node_refs refs = probe_node_refs(*tree.node, probes, &matches);
+      const uint nruns = std::max(1u, std::min<uint>(refs.size() / grain,
+						     pool.size()));
 
-  if (dhisto.HasMember(k::extension))
-    {
-      std::clog << k::extension << std::endl;
-      const rj::Value& dext = dhisto[k::extension];
-      extract_histogram_nodes(dext, found, remain, ofs, hvw);
-    }
+      std::vector<id_value_rows> rows(nruns);
+      std::vector<sanity_log_buffer> logs(nruns);
+      auto extractf = [&](const uint r)
+      {
+	sanity_log_scope scope(logs[r]);
+	const size_t first = refs.size() * r / nruns;
+	const size_t last = refs.size() * (r + 1) / nruns;
+	for (size_t i = first; i < last; ++i)
+	  {
+	    const auto& [ id, node ] = refs[i];
+	    string nvalue;
+	    if (tree.histogramp)
+	      nvalue = extract_histogram_node<_View>(*node, probes[id]);
+	    else
+	      nvalue = field_value_to_string(*node);
+	    if (!nvalue.empty())
+	      rows[r].emplace_back(id, nvalue);
+	  }
+      };
 
-  if (dhisto.HasMember(k::dynamic))
-    {
-      std::clog << k::dynamic << std::endl;
-      const rj::Value& ddyn = dhisto[k::dynamic];
-      extract_histogram_nodes(ddyn, found, remain, ofs, hvw);
-    }
+      if (nruns == 1)
+	extractf(0);
+      else
+	{
+	  task_group tasks(pool);
+	  for (uint r = 0; r < nruns; ++r)
+	    tasks.run([&, r] { extractf(r); });
+	  tasks.wait();
+	}
 
-  if (dhisto.HasMember(k::gpu))
-    {
-      std::clog << k::gpu << std::endl;
-      const rj::Value& dgpu = dhisto[k::gpu];
-      extract_histogram_nodes(dgpu, found, remain, ofs, hvw);
+      id_value_rows trows;
+      for (uint r = 0; r < nruns; ++r)
+	{
+	  logs[r].write();
+	  trows.insert(trows.end(), rows[r].begin(), rows[r].end());
+	}
+      const uint nfound = serialize_new_probe_rows(trows, matches, ofs);
+      update_matches(nfound, matches);
+      nmatched += nfound;
     }
+  timer.count("probes_matched", nmatched);
+  timer.count("probes_remaining", matches.remain_size());
+}
 
-  if (dhisto.HasMember(k::socket))
-    {
-      std::clog << k::socket << std::endl;
-      const rj::Value& dsocket = dhisto[k::socket];
-      extract_histogram_nodes(dsocket, found, remain, ofs, hvw);
-    }
+
+// Histogram node and sub-nodes.
+template<histogram_view_t _View>
+void
+extract_histograms_mozilla(const rj::Value& dhisto,
+			   probe_matches& matches, ostream& ofs)
+{
+  probe_subtrees trees;
+  collect_histogram_subtrees(dhisto, trees);
+  extract_probe_subtrees<_View>(trees, matches, ofs);
 }
 
 
 // Scalar node and sub-nodes.
 void
 extract_scalars_mozilla(const rj::Value& dscal,
-			strings& found, strings& remain, ostream& ofs)
+			probe_matches& matches, ostream& ofs)
 {
-  // Extract scalar values.
-  extract_scalar_nodes(dscal, found, remain, ofs);
-
-  if (dscal.HasMember(k::content))
-    {
-      const rj::Value& dcontent = dscal[k::content];
-      extract_scalar_nodes(dcontent, found, remain, ofs);
-    }
-
-  if (dscal.HasMember(k::parent))
-    {
-      const rj::Value& dparent = dscal[k::parent];
-      extract_scalar_nodes(dparent, found, remain, ofs);
-    }
+  probe_subtrees trees;
+  collect_scalar_subtrees(dscal, trees);
+  extract_probe_subtrees<histogram_view_t::median>(trees, matches, ofs);
 }
 
 
 void
-extract_maybe_stringified(const rj::Value& vnode, strings& found,
-			  strings& remain, ostream& ofs, auto fn)
+extract_maybe_stringified(const rj::Value& vnode, probe_matches& matches,
+			  ostream& ofs, json_pool& pool, auto fn)
 {
   const bool is_array(vnode.IsArray());
   const bool is_object(vnode.IsObject());
@@ -189,16 +248,14 @@ extract_maybe_stringified(const rj::Value& vnode, strings& found,
 
   if (is_object)
     {
-      fn(vnode, found, remain, ofs);
+      fn(vnode, matches, ofs);
     }
 
   if (is_string)
     {
-      std::string stringified = vnode.GetString();
-      rj::Document d = parse_stringified_json_to_dom(stringified);
-
+      rj::Document d = parse_stringified_json_to_dom(vnode, pool);
       if (d.IsObject())
-	fn(d, found, remain, ofs);
+	fn(d, matches, ofs);
     }
 
   if (!is_object && !is_string)
@@ -211,8 +268,8 @@ extract_maybe_stringified(const rj::Value& vnode, strings& found,
 
 
 void
-extract_maybe_stringified(const rj::Value& vnode, strings& found,
-			  strings& remain, ostream& ofs,
+extract_maybe_stringified(const rj::Value& vnode, probe_matches& matches,
+			  ostream& ofs, json_pool& pool,
 			  const histogram_view_t hvw, auto fn)
 {
   const bool is_array(vnode.IsArray());
@@ -221,16 +278,14 @@ extract_maybe_stringified(const rj::Value& vnode, strings& found,
 
   if (is_object)
     {
-      fn(vnode, found, remain, ofs, hvw);
+      fn(vnode, matches, ofs, hvw);
     }
 
   if (is_string)
     {
-      std::string stringified = vnode.GetString();
-      rj::Document d = parse_stringified_json_to_dom(stringified);
-
+      rj::Document d = parse_stringified_json_to_dom(vnode, pool);
       if (d.IsObject())
-	fn(d, found, remain, ofs, hvw);
+	fn(d, matches, ofs, hvw);
     }
 
   if (!is_object && !is_string)
@@ -250,7 +305,7 @@ extract_mozilla_glean(string ifile)
   ofstream ofs(make_data_file(ofname, k::csv_ext));
 
   // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(ifile));
+  json_dom dom(deserialize_json_to_dom(ifile));
 
   // Given the known details of the Mozilla android telemetry data schema,
   // save off the most used data nodes for speedier manipulation for
@@ -298,24 +353,23 @@ extract_mozilla_glean(string ifile)
 
 /// Extract histograms, scalars, and environment info from snapshot node.
 void
-extract_mozilla_snapshot(const rj::Value& dvendor, string inames, string ifile)
+extract_mozilla_snapshot(const rj::Value& dvendor, const edit_list& edits,
+			 const string& istem, json_pool& pool)
 {
-  // Read probe names from input file, and put into vector<string>
-  strings probes = deserialize_file_to_strings(inames);
+  // Probe names from edit list.
+  const probe_index& probes = edits._M_probes;
 
-  string ofname(file_path_to_stem(ifile) + "-x-" + "telemetry");
+  string ofname(istem + "-x-" + "telemetry");
   std::ofstream ofs(make_data_file(ofname, k::csv_ext));
 
-  strings found;
-  strings remain(probes);
+  probe_matches matches(probes);
 
   if (dvendor.HasMember(k::phistograms))
     {
       std::clog << k::phistograms << " snapshot start" << std::endl;
       const rj::Value& dhisto = dvendor[k::phistograms];
-      auto fn = extract_histograms_mozilla;
-      const histogram_view_t hwv = histogram_view_t::median;
-      extract_maybe_stringified(dhisto, found, remain, ofs, hwv, fn);
+      auto fn = extract_histograms_mozilla<histogram_view_t::median>;
+      extract_maybe_stringified(dhisto, matches, ofs, pool, fn);
       std::clog << "histogram snapshot end" << std::endl << std::endl;
     }
 
@@ -324,7 +378,7 @@ extract_mozilla_snapshot(const rj::Value& dvendor, string inames, string ifile)
       std::clog << k::pscalars << " snapshot start" << std::endl;
       const rj::Value& dscal = dvendor[k::pscalars];
       auto fn = extract_scalars_mozilla;
-      extract_maybe_stringified(dscal, found, remain, ofs, fn);
+      extract_maybe_stringified(dscal, matches, ofs, pool, fn);
       std::clog << "scalar snapshot end" << std::endl << std::endl;
     }
 
@@ -336,8 +390,7 @@ extract_mozilla_snapshot(const rj::Value& dvendor, string inames, string ifile)
       environment env = { };
       if (denv.IsString())
 	{
-	  std::string stringified = denv.GetString();
-	  rj::Document d = parse_stringified_json_to_dom(stringified);
+	  rj::Document d = parse_stringified_json_to_dom(denv, pool);
 	  env = extract_environment_mozilla(d, true);
 	}
       if (denv.IsObject())
@@ -349,70 +402,148 @@ extract_mozilla_snapshot(const rj::Value& dvendor, string inames, string ifile)
 }
 
 
+/**
+   Reduce the nodes captured by @h to values, and serialize them
+   target by target, with the same found/remain accounting as
+   extract_probe_subtrees: a probe is taken from the first target
+   that has it.
+
+   Captures are parsed and reduced in parallel, in runs within each
+   target, each capture with its own buffered sanity check log lines.
+   Then targets are merged in order, dropping probes already found
+   along with their log lines, so the rows, the logs, and their order
+   are the same as reducing them one after another.
+*/
+template<histogram_view_t _View>
+void
+serialize_stream_values(const probe_stream_handler& h,
+			probe_matches& matches, ostream& ofs)
+{
+  // Fewest captures in one task, under which splitting costs more.
+  constexpr uint grain = 32;
+
+  struct reduced
+  {
+    uint		id;
+    string		value;
+    sanity_log_buffer	log;
+  };
+
+  const probe_index& probes = matches._M_index;
+  const uint ntargets = h._M_targets.size();
+  std::vector<std::vector<reduced>> values(ntargets);
+  for (uint t = 0; t < ntargets; ++t)
+    values[t].resize(h._M_captures[t].size());
+
+  auto reducef = [&](const uint t, const size_t first, const size_t last)
+  {
+    const bool histogramp = h._M_targets[t].kind == stream_node_t::histogram;
+    for (size_t i = first; i < last; ++i)
+      {
+	const auto& [ probe, json ] = h._M_captures[t][i];
+	reduced& r = values[t][i];
+	r.id = probes.find(probe);
+
+	rj::Document d;
+	d.Parse(json.data(), json.size());
+	if (d.HasParseError())
+	  continue;
+
+	sanity_log_scope scope(r.log);
+	if (histogramp)
+	  r.value = extract_histogram_node<_View>(d, probe);
+	else
+	  r.value = field_value_to_string(d);
+      }
+  };
+
+  thread_pool& pool = shared_thread_pool();
+  task_group tasks(pool);
+  for (uint t = 0; t < ntargets; ++t)
+    {
+      const size_t n = h._M_captures[t].size();
+      const uint nruns = std::max(1u, std::min<uint>(n / grain, pool.size()));
+      for (uint r = 0; r < nruns && n > 0; ++r)
+	tasks.run([&, t, n, r, nruns]
+		  { reducef(t, n * r / nruns, n * (r + 1) / nruns); });
+    }
+  tasks.wait();
+
+  for (uint t = 0; t < ntargets; ++t)
+    {
+      if (h._M_targets[t].kind == stream_node_t::subtree)
+	continue;
+
+      id_value_rows rows;
+      for (reduced& r : values[t])
+	{
+	  if (r.id == probe_index::npos || matches.test(r.id))
+	    continue;
+	  r.log.write();
+	  if (!r.value.empty())
+	    rows.emplace_back(r.id, std::move(r.value));
+	}
+      const uint nfound = serialize_new_probe_rows(rows, matches, ofs);
+      update_matches(nfound, matches);
+    }
+}
+
+
 /*
   Takes two arguments
 
   1. text file with probe names to extract from Mozilla telemetry.
-  2. input telemetry main ping JSON file
+  2. input telemetry android ping JSON file
 
   Output is a CSV file of probe names with extracted values
 
+  The ping is read with rj::Reader, and no DOM is built for it, just
+  for the probes in the edit list.
+
   Top-level fields:
   scalars
   keyedScalars
   histograms
   keyedHistograms
  */
+template<histogram_view_t _View = histogram_view_t::sum>
 void
-extract_mozilla_android(const string ifile, const string inames)
+extract_mozilla_android_stream(const string ifile, const edit_list& edits)
 {
-  // Read probe names from input file, and put into vector<string>
-  strings probes = deserialize_file_to_strings(inames);
+  // Probe names from edit list.
+  const probe_index& probes = edits._M_probes;
 
-  string ofname(file_path_to_stem(ifile) + "-x-" + file_path_to_stem(inames));
+  string ofname(file_path_to_stem(ifile) + "-x-" + file_path_to_stem(edits._M_file));
   std::ofstream ofs(make_data_file(ofname, k::csv_ext));
 
-  // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(ifile));
-
-  // Given the known details of the Mozilla android telemetry data schema,
-  // save off the most used data nodes for speedier manipulation for
-  // specific probes.
-  const string kscalar("scalars");
-  const string kkeyedscalar("keyedScalars");
-  const string khistogram("histograms");
-  const string kkeyedhistogram("keyedHistograms");
-
-  strings found;
-  strings remain(probes);
-  if (dom.HasMember(kscalar.c_str()))
-    {
-      const rj::Value& ds = dom[kscalar.c_str()];
-      extract_scalars_mozilla(ds, found, remain, ofs);
-    }
-  std::clog << "done scalar" << std::endl;
-
-  if (dom.HasMember(kkeyedscalar.c_str()))
-    {
-      const rj::Value& dks = dom[kkeyedscalar.c_str()];
-      extract_scalars_mozilla(dks, found, remain, ofs);
-    }
-  std::clog << "done keyed scalar" << std::endl;
-
-  auto hwv = histogram_view_t::sum;
-  if (dom.HasMember(khistogram.c_str()))
-    {
-      const rj::Value& dhisto = dom[khistogram.c_str()];
-      extract_histograms_mozilla(dhisto, found, remain, ofs, hwv);
-    }
-  std::clog << "done histogram" << std::endl;
-
-  if (dom.HasMember(kkeyedhistogram.c_str()))
-    {
-      const rj::Value& dkhisto = dom[kkeyedhistogram.c_str()];
-      extract_histograms_mozilla(dkhisto, found, remain, ofs, hwv);
-    }
-  std::clog << "done keyed histogram" << std::endl;
+  // Scalar, then histogram nodes, each with its process sub-nodes.
+  // Key paths are the same for every input, so made once.
+  using node = stream_node_t;
+  static const stream_targets targets = []
+  {
+    stream_targets ts;
+    for (const string ks : { "scalars", "keyedScalars" })
+      {
+	ts.push_back({ { ks }, node::scalar });
+	ts.push_back({ { ks, k::content }, node::scalar });
+	ts.push_back({ { ks, k::parent }, node::scalar });
+      }
+    for (const string kh : { "histograms", "keyedHistograms" })
+      {
+	ts.push_back({ { kh }, node::histogram });
+	for (const string kp : { k::content, k::parent, k::extension,
+				 k::dynamic, k::gpu, k::socket })
+	  ts.push_back({ { kh, kp }, node::histogram });
+      }
+    return ts;
+  }();
+
+  probe_stream_handler h(targets, probes);
+  stream_json_file(ifile, h);
+
+  probe_matches matches(probes);
+  serialize_stream_values<_View>(h, matches, ofs);
+  std::clog << "done stream extract" << std::endl;
 }
 
 
@@ -422,7 +553,11 @@ extract_mozilla_android(const string ifile, const string inames)
   1. text file with probe names to extract from Mozilla telemetry.
   2. input telemetry main ping JSON file
 
-  Output is a CSV file of probe names with extracted values
+  Output is a CSV file of probe names with extracted values, and the
+  environment files.
+
+  The main ping is read with rj::Reader, and no DOM is built for it,
+  just for the probes in the edit list and the environment node.
 
   Top-level fields for main ping:
 
@@ -435,74 +570,66 @@ extract_mozilla_android(const string ifile, const string inames)
   clientId
   environment
  */
+template<histogram_view_t _View = histogram_view_t::median>
 void
-extract_mozilla_desktop(const string ifile, const string inames)
+extract_mozilla_desktop_stream(const string ifile, const edit_list& edits)
 {
-  // Read probe names from input file, and put into vector<string>
-  strings probes = deserialize_file_to_strings(inames);
+  // Probe names from edit list.
+  const probe_index& probes = edits._M_probes;
 
-  string ofname(file_path_to_stem(ifile) + "-x-" + file_path_to_stem(inames));
+  string ofname(file_path_to_stem(ifile) + "-x-" + file_path_to_stem(edits._M_file));
   std::ofstream ofs(make_data_file(ofname, k::csv_ext));
 
-  // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(ifile));
-
-  // Given the known details of the Mozilla telemetry data schema,
-  // save off the most used data nodes for speedier manipulation for
-  // specific probes.
+  // Histograms, then scalars, then the environment subtrees.
   const string kpayload("payload");
-  if (dom.HasMember(kpayload.c_str()))
+  const string khistograms("histograms");
+  const string kscalars("scalars");
+  const string kenvironment("environment");
+  const char* suri = "browser.engagement.unfiltered_uri_count";
+
+  using node = stream_node_t;
+  static const stream_targets targets =
     {
-      strings found;
-      strings remain(probes);
-
-      // payload
-      // payload/histograms
-      // payload/simple
-      const string khistograms("histograms");
-      const string kscalars("scalars");
-      const string ksimple("simpleMeasurements");
-      const rj::Value& dpayload = dom[kpayload.c_str()];
-      const rj::Value& dhisto = dpayload[khistograms.c_str()];
-      const rj::Value& dsimple = dpayload[ksimple.c_str()];
-
-      // payload/processes
-      // payload/processes/content/histograms
-      const string kproc("processes");
-      const string kcontent("content");
-      const rj::Value& dproc = dpayload[kproc.c_str()];
-      const rj::Value& dcont = dproc[kcontent.c_str()][khistograms.c_str()];;
-
-      // payload/processes/gpu
-      const string kgpu("gpu");
-      const rj::Value& dgpu = dproc[kgpu.c_str()][khistograms.c_str()];
-
-      // payload/processes/parent/scalars
-      const string kparent("parent");
-      const rj::Value& dparent = dproc[kparent.c_str()][kscalars.c_str()];
-
-      // Extract histogram values.
-      // list_object_fields(dhistogram);
-      auto hvw = histogram_view_t::median;
-      extract_histogram_nodes(dhisto, found, remain, ofs, hvw);
-      extract_histogram_nodes(dcont, found, remain, ofs, hvw);
-      extract_histogram_nodes(dgpu, found, remain, ofs, hvw);
-
-      // Extract scalar values.
-      // list_object_fields(dsimple);
-      extract_scalar_nodes(dsimple, found, remain, ofs);
-      extract_scalar_nodes(dparent, found, remain, ofs);
+      { { kpayload, khistograms }, node::histogram },
+      { { kpayload, k::process, k::content, khistograms }, node::histogram },
+      { { kpayload, k::process, k::gpu, khistograms }, node::histogram },
+      { { kpayload, "simpleMeasurements" }, node::scalar },
+      { { kpayload, k::process, k::parent, kscalars }, node::scalar },
+      { { kenvironment }, node::subtree },
+      { { kpayload, k::process, k::parent, kscalars, suri }, node::subtree }
+    };
+
+  probe_stream_handler h(targets, probes);
+  stream_json_file(ifile, h);
+
+  if (h._M_seen[0])
+    {
+      probe_matches matches(probes);
+      serialize_stream_values<_View>(h, matches, ofs);
 
       // List remain.
       std::clog << std::endl;
-      std::clog << remain.size() << " remain probes: " << std::endl;
-      for (const string& s : remain)
+      std::clog << matches.remain_size() << " remain probes: " << std::endl;
+      for (const string& s : matches.remain())
 	std::clog << '\t' << s << std::endl;
       std::clog << std::endl;
 
       // Extract and serialize environmental metadata.
       std::clog << "extracing environment metadata: ";
-      environment env = extract_environment_mozilla(dom);
+      environment env = { };
+      const string& senv = h._M_subtrees[5];
+      if (!senv.empty())
+	{
+	  rj::Document denv = parse_stringified_json_to_dom(senv);
+	  env = extract_environment_mozilla(denv, true);
+
+	  const string& suricount = h._M_subtrees[6];
+	  if (!suricount.empty())
+	    {
+	      rj::Document duri = parse_stringified_json_to_dom(suricount);
+	      env.uri_count = duri.GetInt();
+	    }
+	}
       serialize_environment(env, ofname);
       std::clog << "done" << std::endl;
     }
@@ -636,8 +763,43 @@ extract_browsertime_statistics(const rj::Value& v, const histogram_view_t dview,
 
 
 
+/**
+   Rows of CSV text @data with a name in @probes, in one pass. Names
+   must match the whole first field of the line, so that firstPaint
+   does not match timeToFirstPaint or firstPaintX. The first row for
+   each name is kept, and rows are in sorted edit list order.
+*/
+string
+filter_csv_rows(std::string_view data, const probe_index& probes)
+{
+  std::vector<std::string_view> rows(probes.size());
+  const char* first = data.data();
+  const char* const end = first + data.size();
+  while (first != end)
+    {
+      const char* last = std::find(first, end, k::newline);
+      const char* comma = std::find(first, last, k::comma);
+      const uint id = probes.find(std::string_view(first, comma - first));
+      if (id != probe_index::npos && rows[id].empty())
+	rows[id] = std::string_view(first, last - first);
+      first = last == end ? end : last + 1;
+    }
+
+  string ret;
+  for (const std::string_view row : rows)
+    {
+      if (!row.empty())
+	{
+	  ret += row;
+	  ret += k::newline;
+	}
+    }
+  return ret;
+}
+
+
 /*
-  Extract from a browsertime JSON @ifile all the with probe names in @inames
+  Extract from a browsertime JSON @ifile all the with probe names in @edits
 
   Top-level fields:
 
@@ -667,41 +829,38 @@ extract_browsertime_statistics(const rj::Value& v, const histogram_view_t dview,
   HAR 1.2
   http://www.softwareishard.com/blog/har-12-spec/
 
-  ifile == input JSON file
+  dom == parsed input JSON
+  istem == input file stem, output file names are derived from this
   iname == input edit list file, text newline delimited
   dview == type of histogram extraction (defaults to median)
   deviations == number of variance values to extract
   manglemetricp == add metric cosmology to output csv file name
+  store == if not null, also append the output as a run to this store
  */
 void
-extract_browsertime(string ifile, string inames, const histogram_view_t dview,
-		    const uint deviations = 0, const bool manglemetricp = false)
+extract_browsertime(const rj::Document& dom, const string& istem,
+		    const edit_list& edits, const histogram_view_t dview,
+		    const uint deviations = 0, const bool manglemetricp = false,
+		    metric_store_writer* store = nullptr)
 {
   // Setup output.
-  string ofname(file_path_to_stem(ifile));
-  if (!inames.empty() && manglemetricp)
+  string ofname(istem);
+  if (!edits._M_file.empty() && manglemetricp)
     {
       ofname += "-x-";
-      string ifname(file_path_to_stem(inames));
+      string ifname(file_path_to_stem(edits._M_file));
       ofname += ifname;
     }
   const string extname('.' + to_string(deviations + 2) + k::csv_ext);
   ofstream ofs(make_data_file(ofname, extname));
   ostringstream oss;
-
-  // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(ifile));
-  if (dom.HasParseError())
-    {
-      std::clog << "error: failed to parse JSON in " << ifile << std::endl;
-      exit(12);
-    }
+  environment env = { };
 
   // Depending on the browsertime version, extraction varies.
   // Data is either an array of objects or just one object. If it is
   // an array, just use the first one.
   string browsertimev;
-  rj::Value* bv = rj::Pointer("/info/browsertime/version").Get(dom);
+  const rj::Value* bv = rj::Pointer("/info/browsertime/version").Get(dom);
   if (bv)
     {
       const rj::Value& v = *bv;
@@ -719,14 +878,14 @@ extract_browsertime(string ifile, string inames, const histogram_view_t dview,
       //statistics/timing
       //statistics/timing/navigationTiming
       //statistics/timing/pageTimings
-      rj::Value* pv = rj::Pointer("/statistics/timings").Get(dom);
+      const rj::Value* pv = rj::Pointer("/statistics/timings").Get(dom);
       if (pv)
 	{
 	  const rj::Value& v = *pv;
 	  extract_browsertime_statistics(v, dview, oss, deviations);
 
 	  // Extract and serialize environmental metadata.
-	  environment env = extract_environment_browsertime(dom);
+	  env = extract_environment_browsertime(dom);
 	  serialize_environment(env, ofname);
 	}
       else
@@ -740,6 +899,9 @@ extract_browsertime(string ifile, string inames, const histogram_view_t dview,
       bool vendorp = false;
       bool browserscriptsp = false;
 
+      // Nested DOMs of stringified snapshots, all from one pool.
+      json_pool pool;
+
       std::clog << "dom array size " << dom.Size() << std::endl << std::endl;
       for (uint i = 0; i < dom.Size(); ++i)
 	{
@@ -756,7 +918,7 @@ extract_browsertime(string ifile, string inames, const histogram_view_t dview,
 		  extract_browsertime_statistics(vs, dview, oss, deviations);
 
 		  // Extract and serialize environmental metadata, then stop.
-		  environment env = extract_environment_browsertime(v);
+		  env = extract_environment_browsertime(v);
 		  serialize_environment(env, ofname);
 		}
 
@@ -774,7 +936,7 @@ extract_browsertime(string ifile, string inames, const histogram_view_t dview,
 			      vendorp = true;
 			      const rj::Value& vendor = vssub[k::vendor];
 			      if (list_object_fields(vendor, "", false) > 0)
-				extract_mozilla_snapshot(vendor, inames, ifile);
+				extract_mozilla_snapshot(vendor, edits, istem, pool);
 			    }
 			}
 		    }
@@ -796,274 +958,743 @@ extract_browsertime(string ifile, string inames, const histogram_view_t dview,
 
   std::clog << std::endl << "end dom extract" << std::endl;
 
-  // Read edit list of probe/metric names from input file, and put
-  // into vector<string>.
-  strings ids = deserialize_file_to_strings(inames);
-  if (!ids.empty())
+  // Edit list of probe/metric names, or extract all.
+  string orows;
+  if (!edits._M_probes.empty())
     {
-      // Do edit list only.
-      const string ostring(oss.str());
-      for (const string& metric : ids)
+      scoped_timer timer("match_probes", istem);
+      orows = filter_csv_rows(oss.str(), edits._M_probes);
+      if (timer.enabledp())
 	{
-	  auto startpos = ostring.find(metric);
-	  if (startpos != string::npos)
-	    {
-	      auto endpos = ostring.find(k::newline, startpos);
-	      if (endpos != string::npos)
-		{
-		  ofs << ostring.substr(startpos, endpos - startpos);
-		  ofs << k::newline;
-		}
-	    }
+	  const csv_rows matched = parse_csv(orows);
+	  timer.count("probes_matched", matched.size());
+	  timer.count("probes_remaining",
+		      edits._M_probes.size() - matched.size());
 	}
     }
   else
+    orows = oss.str();
+  ofs << orows;
+
+  if (store)
+    store->add_run(ofname, env, parse_csv(orows));
+}
+
+
+/// Extract from browsertime JSON file @ifile, plain or compressed.
+void
+extract_browsertime(string ifile, const edit_list& edits,
+		    const histogram_view_t dview,
+		    const uint deviations = 0, const bool manglemetricp = false,
+		    metric_store_writer* store = nullptr)
+{
+  // Load input JSON data file into DOM.
+  json_dom dom(deserialize_json_to_dom(ifile));
+  if (dom.HasParseError())
     {
-      // Extract all.
-      ofs << oss.str();
+      string m("extract_browsertime:: error, failed to parse JSON in file: ");
+      m += ifile;
+      throw std::runtime_error(m);
     }
+
+  extract_browsertime(dom, file_path_to_stem(ifile), edits, dview,
+		      deviations, manglemetricp, store);
 }
 
 
-/**
+// Minified version of URL that just has TLD name, aka "amazon" or "tripadvisor"
+// Find the shortest name, print it to stdout.
+void
+extract_browsertime_url(string ifile)
+{
+  // Load input JSON data file into DOM.
+  json_dom dom(deserialize_json_to_dom(ifile));
+  if (dom.HasParseError())
+    {
+      string m("extract_browsertime_url:: error, failed to parse JSON");
+      m += " in file: ";
+      m += ifile;
+      throw std::runtime_error(m);
+    }
 
-Parse the log bits that look like this:
+  // Find string.
+  rj::Value* iurl = rj::Pointer("/0/info/url").Get(dom);
+  if (iurl)
+    {
+      const rj::Value& v = *iurl;
+      string url = field_value_to_string(v);
 
-Fenix
-[2020-07-21 22:11:47] INFO: [browsertime] https://cnn.com/ampstories/us/why-hurricane-michael-is-a-monster-unlike-any-other TTFB: 419ms (±37.43ms), firstPaint: 1.12s (±70.13ms), firstVisualChange: 2.27s (±53.92ms), DOMContentLoaded: 529ms (±39.98ms), Load: 1.47s (±64.08ms), speedIndex: 2.29s (±52.76ms), perceptualSpeedIndex: 2.29s (±52.78ms), contentfulSpeedIndex: 2.27s (±53.91ms), visualComplete85: 2.29s (±52.93ms), lastVisualChange: 2.75s (±52.84ms) (10 runs)
+      // Strip url into smallest possible value, aka the domain no TLD.
+      url = url_to_domain(url);
 
-Chrome
-[2020-07-21 21:15:13] INFO: [browsertime] https://cnn.com/ampstories/us/why-hurricane-michael-is-a-monster-unlike-any-other 28 requests, TTFB: 357ms (±103.34ms), firstPaint: 1.84s (±95.03ms), firstVisualChange: 2.14s (±91.56ms), FCP: 2.16s (±92.83ms), DOMContentLoaded: 510ms (±104.30ms), LCP: 1.78s (±108.67ms), CLS: 0 (±0.00), Load: 1.42s (±211.46ms), speedIndex: 2.25s (±89.90ms), perceptualSpeedIndex: 2.24s (±89.95ms), contentfulSpeedIndex: 2.14s (±93.25ms), visualComplete85: 2.26s (±91.85ms), lastVisualChange: 2.26s (±91.85ms) (10 runs)
+      std::cout << url << std::endl;
+    }
+  else
+    {
+      string m("extract_browsertime_url:: error, cannot find URL field");
+      m +=  " in file: ";
+      m += ifile;
+      m += k::newline;
+      throw std::runtime_error(m);
+    }
+}
 
-Pass these logs to 3-field CSV of form (metric,time in ms, variance in ms) as:
-TTFB,357,103.34
 
-logfile = input browsertime log file
-inames = input file of probe names to find in log file, if none extract all
-iterations = number of browsertime interations in log file
- */
+/// Default histogram view for @schema: sum for android, otherwise median.
+constexpr histogram_view_t
+default_histogram_view(const json_t schema)
+{
+  return schema == json_t::mozilla_android
+    ? histogram_view_t::sum : histogram_view_t::median;
+}
+
+
+/// View @view can be extracted from @schema. Browsertime has only
+/// pre-computed median and mean fields, and the schemas without
+/// histograms only take the default.
+constexpr bool
+histogram_view_p(const json_t schema, const histogram_view_t view)
+{
+  switch (schema)
+    {
+    case json_t::browsertime:
+      return view == histogram_view_t::median
+	|| view == histogram_view_t::mean;
+    case json_t::mozilla_desktop:
+    case json_t::mozilla_android:
+      return true;
+    default:
+      return view == default_histogram_view(schema);
+    }
+}
+
+
+// Not extracted, for the static_assert in extract_identifiers.
+template<json_t _Schema>
+  constexpr bool unsupported_schema_v = false;
+
+
+/**
+   Extract input file @idata of schema _Schema, with histograms as
+   view _View. Each instantiation has only the code for its schema.
+   For the mozilla schemas the view is a template argument all the way
+   down to the loop over probes, so neither is tested at run time.
+   Browsertime takes the view as an argument, for its few pre-computed
+   summary fields.
+*/
+template<json_t _Schema, histogram_view_t _View
+	 = default_histogram_view(_Schema)>
 void
-extract_browsertime_log(const string logfile, const string inames,
-			const uint iterations = 10)
+extract_identifiers(const string& idata, const edit_list& edits,
+		    const uint deviations = 0,
+		    metric_store_writer* store = nullptr)
 {
-  // Do edit list.
-  // Read probe names from input file, and put into vector<string>
-  strings probes = deserialize_file_to_strings(inames);
-  const auto probends = probes.end();
-
-  std::ostringstream ostrs;
-  std::ifstream ifs(logfile);
-  if (ifs.good())
+  if constexpr (_Schema == json_t::browsertime)
+    extract_browsertime(idata, edits, _View, deviations, false, store);
+  else if constexpr (_Schema == json_t::browsertime_log)
+    extract_browsertime_log(idata, edits);
+  else if constexpr (_Schema == json_t::browsertime_url)
+    extract_browsertime_url(idata);
+  else if constexpr (_Schema == json_t::mozilla_desktop)
+    extract_mozilla_desktop_stream<_View>(idata, edits);
+  else if constexpr (_Schema == json_t::mozilla_android)
+    extract_mozilla_android_stream<_View>(idata, edits);
+  else if constexpr (_Schema == json_t::mozilla_glean)
+    extract_mozilla_glean(idata);
+  else
+    static_assert(unsupported_schema_v<_Schema>, "schema not extracted");
+}
+
+
+// Dispatch once on @view to the instantiation of extract_identifiers
+// for _Schema, which has histograms in every view.
+template<json_t _Schema>
+void
+dispatch_histogram_view(const string& idata, const edit_list& edits,
+			const histogram_view_t view)
+{
+  switch (view)
     {
-      ostrs << ifs.rdbuf();
-      string raw = ostrs.str();
+    case histogram_view_t::sum:
+      extract_identifiers<_Schema, histogram_view_t::sum>(idata, edits);
+      break;
+    case histogram_view_t::median:
+      extract_identifiers<_Schema, histogram_view_t::median>(idata, edits);
+      break;
+    case histogram_view_t::mean:
+      extract_identifiers<_Schema, histogram_view_t::mean>(idata, edits);
+      break;
+    case histogram_view_t::quantile:
+      extract_identifiers<_Schema, histogram_view_t::quantile>(idata, edits);
+      break;
+    case histogram_view_t::range:
+      extract_identifiers<_Schema, histogram_view_t::range>(idata, edits);
+      break;
+    case histogram_view_t::stddev:
+      extract_identifiers<_Schema, histogram_view_t::stddev>(idata, edits);
+      break;
+    case histogram_view_t::mdev:
+      extract_identifiers<_Schema, histogram_view_t::mdev>(idata, edits);
+      break;
+    }
+}
 
-      // Find summary results block, save it off for detailed parsing.
-      string resultsblock;
-      auto lastttfbpos = raw.rfind("TTFB: ");
-      if (lastttfbpos != string::npos)
-	{
-	  const string runsstr(" (" + to_string(iterations) + " runs)");
-	  auto lastiterpos = raw.rfind(runsstr);
-	  if (lastiterpos != string::npos)
-	    {
-	      resultsblock = raw.substr(lastttfbpos, lastiterpos - lastttfbpos);
-	      std::cout << "results block raw: " << std::endl;
-	      std::cout << resultsblock << std::endl << std::endl;
-	    }
-	}
+
+// Main entry point for extraction, dispatch once on @schema and @view
+// to their instantiation of extract_identifiers.
+void
+extract_identifiers(string idata, const edit_list& edits, const json_t schema,
+		    const histogram_view_t view, const uint deviations = 0,
+		    metric_store_writer* store = nullptr)
+{
+  if (!histogram_view_p(schema, view))
+    throw std::runtime_error(k::errorprefix + "extract_identifiers:: "
+			     + "view " + to_string(view)
+			     + " not extracted for schema "
+			     + to_string(schema));
+
+  constexpr auto bt = json_t::browsertime;
+  switch (schema)
+    {
+    case json_t::browsertime:
+      if (view == histogram_view_t::mean)
+	extract_identifiers<bt, histogram_view_t::mean>(idata, edits,
+							deviations, store);
       else
-	{
-	  string m("extract_browsertime_log::error cannot find results block");
-	  throw std::runtime_error(m);
-	}
+	extract_identifiers<bt, histogram_view_t::median>(idata, edits,
+							  deviations, store);
+      break;
+    case json_t::browsertime_log:
+      extract_identifiers<json_t::browsertime_log>(idata, edits);
+      break;
+    case json_t::browsertime_url:
+      extract_identifiers<json_t::browsertime_url>(idata, edits);
+      break;
+    case json_t::mozilla_desktop:
+      dispatch_histogram_view<json_t::mozilla_desktop>(idata, edits, view);
+      break;
+    case json_t::mozilla_android:
+      dispatch_histogram_view<json_t::mozilla_android>(idata, edits, view);
+      break;
+    case json_t::mozilla_glean:
+      extract_identifiers<json_t::mozilla_glean>(idata, edits);
+      break;
+    default:
+      throw std::runtime_error(k::errorprefix + "extract_identifiers:: "
+			       + "schema not extracted: " + to_string(schema));
+    }
+}
 
-      // Parse summary results block.
-      ostrs.str(string());
-      std::istringstream istrs(resultsblock);
-      do
-	{
-	  string pname;
-	  getline(istrs, pname, ':');
-	  std::cout << pname << std::endl;
 
-	  const bool foundp = find(probes.begin(), probends, pname) != probends;
-	  if (istrs.good() && (foundp || probes.empty()))
-	    {
-	      double pvalue(0);
-	      istrs >> pvalue;
+/**
+   Extract from each browsertime JSON member of tar.xz archive @ifile,
+   one at a time. Members are decompressed from the archive straight
+   into the parse buffer, without temporary files. Output file names
+   are the archive stem and the member stem, so that members with the
+   same name in different archives do not collide.
+
+   Other schemas need a file name for the input, so are not supported.
+*/
+void
+extract_archive(const string& ifile, const edit_list& edits,
+		const json_t schema, const histogram_view_t view,
+		const uint deviations = 0, metric_store_writer* store = nullptr)
+{
+  if (schema != json_t::browsertime)
+    {
+      string m(k::errorprefix + "extract_archive:: ");
+      m += "only browsertime JSON archives are supported: " + ifile;
+      throw std::runtime_error(m);
+    }
 
-	      if (pvalue != 0)
-		{
-		  string timeunit;
-		  istrs >> timeunit;
-		  if (timeunit == "s")
-		    pvalue *= 1000;
-		}
+  const string astem(file_path_to_stem(ifile));
+  const string envext(k::environment_ext);
+  auto wantp = [&envext](const string& name)
+  {
+    const string f(filesystem::path(name).filename().string());
+    const bool envp = f.size() >= envext.size()
+      && f.compare(f.size() - envext.size(), envext.size(), envext) == 0;
+    return f.find("browsertime") != string::npos
+      && f.find(".json") != string::npos && !envp;
+  };
+
+  uint nmembers(0);
+  auto extractf = [&](const string& name, std::vector<char>& buffer)
+  {
+    json_dom dom(deserialize_json_to_dom(std::move(buffer), name));
+    if (dom.HasParseError())
+      {
+	string m("extract_archive:: error, failed to parse JSON in member: ");
+	m += ifile + ':' + name;
+	throw std::runtime_error(m);
+      }
+
+    filesystem::path mpath(name);
+    if (mpath.extension() == ".xz")
+      mpath = mpath.stem();
+    const string istem(astem + '-' + mpath.stem().string());
+    extract_browsertime(dom, istem, edits, view, deviations, false, store);
+    ++nmembers;
+  };
+
+  mapped_file mf(ifile);
+  xz_reader xz(mf.data(), mf.size());
+  for_each_tar_member(xz, wantp, extractf);
+  std::clog << "extracted " << nmembers << " members from archive "
+	    << ifile << std::endl;
+}
 
-	      // Extract variance part as one blob: (±103.34ms),
-	      string varpre;
-	      istrs >> varpre;
 
-	      double variance(0);
-	      if (pvalue != 0)
-		{
-		  std::istringstream ivar(varpre);
-		  if (ivar.good())
-		    {
-		      char c1;
-		      ivar >> c1;
-		      char c2;
-		      ivar >> c2;
-		      char c3;
-		      ivar >> c3;
-		      ivar >> variance;
-
-		      string timeunitv;
-		      ivar >> timeunitv;
-		      if (timeunitv == "s")
-			variance *= 1000;
-		    }
-		}
+// Input files in directory @idir for @schema, without generated files.
+strings
+populate_input_files(const string idir, const json_t schema)
+{
+  strings files;
+  if (schema == json_t::browsertime_log)
+    files = populate_files(idir, ".log", "", "browsertime");
+  else if (schema == json_t::browsertime || schema == json_t::browsertime_url)
+    files = populate_files(idir, ".json", "", "browsertime");
+  else
+    files = populate_files(idir, ".json");
 
-	      // Output as csv.
-	      ostrs << pname << k::comma << pvalue << k::comma << variance
-		    << std::endl;
-	    }
-	  else
-	    {
-	      istrs.ignore(20, k::comma);
-	    }
+  // Archives of browsertime results, members filtered by extract_archive.
+  if (schema == json_t::browsertime)
+    {
+      strings archives = populate_files(idir, k::tarxz_ext);
+      files.insert(files.end(), archives.begin(), archives.end());
+      std::sort(files.begin(), files.end());
+      files.erase(std::unique(files.begin(), files.end()), files.end());
+    }
 
-	  // Extract space after comma and before next probe name.
-	  istrs.ignore(1);
-	}
-      while (istrs.good());
+  const string envext(k::environment_ext);
+  auto envp = [&envext](const string& f)
+  {
+    return f.size() >= envext.size()
+      && f.compare(f.size() - envext.size(), envext.size(), envext) == 0;
+  };
+  files.erase(std::remove_if(files.begin(), files.end(), envp), files.end());
+  return files;
+}
 
 
-      // Results as csv.
-      const string processed(ostrs.str());
-      if (!processed.empty())
+// Schemas that print to stdout and make no output files, not cached.
+constexpr bool
+stdout_schema_p(const json_t schema)
+{ return schema == json_t::browsertime_url; }
+
+
+// Cache settings key for extraction with @inames, @schema, @view,
+// @deviations, and the quantile if the view is quantile.
+string
+extract_settings(const string& inames, const json_t schema,
+		 const histogram_view_t view, const uint deviations)
+{
+  string settings = to_string(int(schema)) + k::hypen
+    + to_string(int(view)) + k::hypen + to_string(deviations);
+  if (view == histogram_view_t::quantile)
+    settings += k::hypen + to_string(histogram_view_quantile());
+  return extract_cache::settings_key(inames, settings);
+}
+
+
+/**
+   Extract one input @idata, either an archive or a file, and return
+   the output files made.
+
+   cache == if not null, skip @idata if it and its outputs are the
+   same as the last extraction with @settings, and otherwise record
+   the outputs made. Not used with @store, as skipped inputs would
+   then be missing from the store.
+*/
+strings
+extract_input(const string& idata, const edit_list& edits,
+	      const json_t schema, const histogram_view_t view,
+	      const uint deviations = 0,
+	      metric_store_writer* store = nullptr,
+	      extract_cache* cache = nullptr, const string& settings = "")
+{
+  string hash;
+  if (cache && cache->up_to_date(idata, settings, hash))
+    {
+      trace_count("extract", "cached_files", 1);
+      return { };
+    }
+
+  scoped_timer timer("extract", idata);
+  strings ofiles;
+  {
+    data_file_recording recording(ofiles);
+    if (tarxz_p(idata))
+      extract_archive(idata, edits, schema, view, deviations, store);
+    else
+      extract_identifiers(idata, edits, schema, view, deviations, store);
+  }
+
+  if (cache)
+    cache->record(idata, hash, settings, ofiles);
+
+  if (timer.enabledp())
+    {
+      std::error_code ec;
+      timer.count("input_bytes", filesystem::file_size(idata, ec));
+      for (const string& ofile : ofiles)
+	timer.count("output_bytes", filesystem::file_size(ofile, ec));
+      timer.count("output_files", ofiles.size());
+    }
+  return ofiles;
+}
+
+
+// Batch extraction of all @files, in parallel, sharing one edit list.
+// Output files are the same as extracting each file by itself.
+void
+extract_identifiers(const strings& files, const edit_list& edits,
+		    const json_t schema, const histogram_view_t view,
+		    const uint deviations = 0,
+		    metric_store_writer* store = nullptr,
+		    extract_cache* cache = nullptr, const string& settings = "")
+{
+  scoped_timer timer("batch");
+  timer.count("files", files.size());
+
+  thread_pool& pool = shared_thread_pool();
+  std::clog << "extracting " << files.size() << " files with "
+	    << pool.size() << " threads" << std::endl;
+
+  std::atomic<uint> nfail(0);
+  parallel_for_each(pool, files, [&](const string& idata)
+  {
+    try
+      {
+	extract_input(idata, edits, schema, view, deviations, store, cache,
+		      settings);
+      }
+    catch (const std::exception& e)
+      {
+	std::cerr << k::errorprefix << idata << ": " << e.what() << std::endl;
+	++nfail;
+      }
+  });
+
+  if (nfail > 0)
+    std::cerr << k::errorprefix << nfail << " files failed" << std::endl;
+  timer.count("failed_files", nfail);
+  if (cache)
+    std::clog << cache->_M_nhits << " files up to date" << std::endl;
+}
+
+
+// Accumulated histograms of many pings, indexed by probe id.
+using histogram_aggregate = std::vector<histogram_accumulator>;
+
+
+void
+merge_aggregate(histogram_aggregate& into, const histogram_aggregate& from)
+{
+  for (uint id = 0; id < from.size(); ++id)
+    into[id].merge(from[id]);
+}
+
+
+/// Add histograms in @ifile main ping named in @probes to @agg. As in
+/// extract_mozilla_desktop_stream, the first of payload, content, and gpu
+/// histograms with a probe is used.
+void
+aggregate_mozilla_desktop(const string& ifile, const probe_index& probes,
+			  histogram_aggregate& agg)
+{
+  json_dom dom(deserialize_json_to_dom(ifile));
+  if (dom.HasParseError() || !dom.IsObject() || !dom.HasMember("payload"))
+    throw std::runtime_error(k::errorprefix + "aggregate_mozilla_desktop:: "
+			     + "no payload in " + ifile);
+
+  const rj::Value& dpayload = dom["payload"];
+  const rj::Value* nodes[] =
+    {
+      rj::Pointer("/histograms").Get(dpayload),
+      rj::Pointer("/processes/content/histograms").Get(dpayload),
+      rj::Pointer("/processes/gpu/histograms").Get(dpayload)
+    };
+
+  probe_matches matches(probes);
+  for (const rj::Value* dhisto : nodes)
+    {
+      if (!dhisto || !dhisto->IsObject())
+	continue;
+      for (vcmem_iterator i = dhisto->MemberBegin();
+	   i != dhisto->MemberEnd(); ++i)
 	{
-	  string oname = logfile.substr(0, logfile.size() - 4) + k::csv_ext;
-	  std::cout << "output filename: " << oname << std::endl << std::endl;
-	  std::cout << "summary block processed as: " << std::endl;
-	  std::cout << processed << std::endl
-		    << std::endl;
-
-	  std::ofstream ofs(oname);
-	  ofs << ostrs.str();
+	  const uint id = probes.find(to_string_view(i->name));
+	  if (id == probe_index::npos || matches.test(id)
+	      || !i->value.IsObject())
+	    continue;
+
+	  const rj::Value& vh = i->value;
+	  uint nentries(0);
+	  const buckets_t buckets = extract_histogram_buckets(vh, nentries);
+	  if (!buckets.empty())
+	    {
+	      auto isum = vh.FindMember("sum");
+	      const int64_t sum = isum != vh.MemberEnd() && isum->value.IsInt64()
+		? isum->value.GetInt64() : 0;
+	      agg[id].add(extract_histogram_layout(vh), buckets, sum);
+	      matches.set(id);
+	    }
 	}
-      else
-	std::cout << "no probes found" << std::endl;
-
     }
- }
+}
 
 
-// Minified version of URL that just has TLD name, aka "amazon" or "tripadvisor"
-// Find the shortest name, print it to stdout.
+/**
+   Merge histograms of the probes in @edits across all main ping
+   @files, and write quantiles of the merged histograms to CSV file
+   ofstem.4.csv, as name,median,stddev,mdev.
+
+   Files are split in chunks, each folded into one aggregate on
+   @pool, then the chunk aggregates are merged pairwise in a parallel
+   tree reduction.
+*/
 void
-extract_browsertime_url(string ifile)
+aggregate_histograms(const strings& files, const edit_list& edits,
+		     const string& ofstem, thread_pool& pool)
 {
-  // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(ifile));
-  if (dom.HasParseError())
+  const probe_index& probes = edits._M_probes;
+  if (probes.empty())
+    throw std::runtime_error(k::errorprefix + "aggregate_histograms:: "
+			     + "edit list of probes is required");
+
+  const uint nchunks = std::max(1u, std::min<uint>(files.size(),
+						   pool.size() * 4));
+  std::vector<histogram_aggregate> parts(nchunks,
+					 histogram_aggregate(probes.size()));
+  std::atomic<uint> nfail(0);
+  {
+    task_group tasks(pool);
+    for (uint c = 0; c < nchunks; ++c)
+      tasks.run([&, c]
+      {
+	for (uint f = c; f < files.size(); f += nchunks)
+	  {
+	    try
+	      {
+		aggregate_mozilla_desktop(files[f], probes, parts[c]);
+	      }
+	    catch (const std::exception& e)
+	      {
+		std::cerr << files[f] << ": " << e.what() << std::endl;
+		++nfail;
+	      }
+	  }
+      });
+    tasks.wait();
+  }
+
+  for (uint stride = 1; stride < nchunks; stride *= 2)
     {
-      std::clog << "error: failed to parse JSON in file: "
-		<< ifile << std::endl;
-      exit(12);
+      task_group tasks(pool);
+      for (uint c = 0; c + stride < nchunks; c += 2 * stride)
+	tasks.run([&, c, stride] { merge_aggregate(parts[c], parts[c + stride]); });
+      tasks.wait();
     }
+  const histogram_aggregate& agg = parts.front();
 
-  // Find string.
-  rj::Value* iurl = rj::Pointer("/0/info/url").Get(dom);
-  if (iurl)
+  std::ofstream ofs(make_data_file(ofstem, ".4" + string(k::csv_ext)));
+  for (uint id = 0; id < probes.size(); ++id)
     {
-      const rj::Value& v = *iurl;
-      string url = field_value_to_string(v);
+      if (agg[id].empty())
+	continue;
+      const buckets_t buckets = agg[id].buckets();
+      ofs << probes[id] << k::comma << histogram_median(buckets)
+	  << k::comma << histogram_stddev(buckets)
+	  << k::comma << histogram_mdev(buckets) << std::endl;
+      std::clog << probes[id] << ": " << agg[id]._M_npings << " pings, "
+		<< histogram_count(buckets) << " samples" << std::endl;
+    }
 
-      // Strip url into smallest possible value, aka the domain no TLD.
-      // Start with: "https://en.m.wikipedia.org/wiki/Main_Page"
-      // End with: "wikipedia"
-      auto protopos = url.find("://");
-      if (protopos != string::npos)
+  std::clog << "aggregated " << files.size() - nfail << " pings into "
+	    << ofstem << std::endl;
+}
+
+
+// Set by SIGINT or SIGTERM, to stop watch_and_extract.
+volatile std::sig_atomic_t watch_stop;
+
+void
+watch_signal(int)
+{ watch_stop = 1; }
+
+
+/// Schema of input file @ifile in a results directory, as in
+/// populate_input_files. False if not an input.
+bool
+watch_input_p(const string& ifile, json_t& schema)
+{
+  const string f(filesystem::path(ifile).filename().string());
+  const string envext(k::environment_ext);
+  const bool envp = f.size() >= envext.size()
+    && f.compare(f.size() - envext.size(), envext.size(), envext) == 0;
+  const bool btp = f.find("browsertime") != string::npos;
+
+  if (tarxz_p(f))
+    schema = json_t::browsertime;
+  else if (btp && f.find(".log") != string::npos)
+    schema = json_t::browsertime_log;
+  else if (btp && f.find(".json") != string::npos && !envp)
+    schema = json_t::browsertime;
+  else
+    return false;
+  return true;
+}
+
+
+/**
+   Watch results directory @idir, and extract then render each new
+   browsertime JSON, log, or archive file as it lands, until SIGINT
+   or SIGTERM.
+
+   One thread reads finished files from inotify and queues them, and
+   the workers take them off the queue to extract and render to svg.
+   The queue is bounded: when the workers fall behind, the reader
+   waits, and further events wait in the kernel queue. If that
+   overflows, the whole tree is scanned again. Inputs are looked up in
+   the extraction cache, so files already done, at start or after a
+   rescan, are skipped, unless @cachep is false.
+*/
+void
+watch_and_extract(const string& idir, const string& inames,
+		  const edit_list& edits, const string& imetrictype,
+		  const string& hilite, const bool cachep = true,
+		  const uint deviations = 2, const size_t capacity = 64)
+{
+  init_id_render_state_cache(0.33, hilite);
+  set_label_spaces(6);
+  const uno_typography typos = make_uno_typography();
+
+  std::unique_ptr<extract_cache> cache;
+  if (cachep)
+    cache = std::make_unique<extract_cache>();
+  bounded_queue<string> queue(capacity);
+
+  // Files queued and not yet taken by a worker.
+  std::mutex pendingm;
+  std::unordered_set<string> pending;
+
+  auto workf = [&]
+  {
+    string ifile;
+    while (queue.pop(ifile))
+      {
 	{
-	  // Shorten the front, eliminate protocol part of URL string.
-	  url = url.substr(protopos + 3);
-
-	  // Look for common TLDs.
-	  auto tldpos = protopos;
-	  auto compos = url.find(".com");
-	  if (compos != string::npos)
-	    tldpos = compos;
-	  else
-	    {
-	      auto orgpos = url.find(".org");
-	      if (orgpos != string::npos)
-		tldpos = orgpos;
-	      else
+	  std::lock_guard<std::mutex> lock(pendingm);
+	  pending.erase(ifile);
+	}
+
+	json_t schema;
+	watch_input_p(ifile, schema);
+	try
+	  {
+	    const histogram_view_t view = default_histogram_view(schema);
+	    const string settings = extract_settings(inames, schema, view,
+						     deviations);
+	    const strings ofiles = extract_input(ifile, edits, schema, view,
+						 deviations, nullptr,
+						 cache.get(), settings);
+	    if (cache && !ofiles.empty())
+	      cache->save();
+
+	    for (const string& ofile : ofiles)
+	      if (ofile.find(k::csv_ext) != string::npos)
 		{
-		  auto netpos = url.find(".net");
-		  if (netpos != string::npos)
-		    tldpos = netpos;
-		  else
+		  try
+		    {
+		      render_radial_uno(ofile, imetrictype, hilite, typos);
+		      std::clog << "rendered " << ofile << std::endl;
+		    }
+		  catch (const std::exception& e)
 		    {
-		      string m("extract_browsertime_url:: error, unknown TLD");
-		      m += " in URL string: ";
-		      m += url;
-		      throw std::runtime_error(m);
+		      std::cerr << k::errorprefix << ofile << ": " << e.what()
+				<< std::endl;
 		    }
 		}
-	    }
-
-	  // Assume TLD found. Now, shorten.
-	  auto ppos = url.rfind('.', tldpos - 1);
-	  if (ppos != string::npos)
-	    url = url.substr(ppos + 1, tldpos - ppos - 1);
-	  else
-	    {
-	      // Assume it's the begining of the string.
-	      url = url.substr(0, tldpos);
-	    }
+	  }
+	catch (const std::exception& e)
+	  {
+	    std::cerr << k::errorprefix << ifile << ": " << e.what()
+		      << std::endl;
+	  }
+      }
+  };
+
+  const uint nthreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> workers;
+  for (uint i = 0; i < nthreads; ++i)
+    workers.emplace_back(workf);
+
+  // Queue input files, waiting while the queue is full.
+  auto queuef = [&](const strings& files)
+  {
+    for (const string& f : files)
+      {
+	json_t schema;
+	if (watch_stop || !watch_input_p(f, schema))
+	  continue;
+	{
+	  std::lock_guard<std::mutex> lock(pendingm);
+	  if (!pending.insert(f).second)
+	    continue;
 	}
-      else
+	queue.push(f);
+      }
+  };
+
+  // Inputs in all directories of the tree.
+  auto scanf = [&]
+  {
+    strings files;
+    std::error_code ec;
+    filesystem::recursive_directory_iterator i(idir, ec), end;
+    strings dirs = { idir };
+    for (; !ec && i != end; i.increment(ec))
+      if (filesystem::is_directory(i->status()))
+	dirs.push_back(i->path().string());
+    for (const string& dir : dirs)
+      for (const json_t schema : { json_t::browsertime,
+				   json_t::browsertime_log })
 	{
-	  string m("extract_browsertime_url:: error, cannot find protocol");
-	  m += " in URL string: ";
-	  m += url;
-	  throw std::runtime_error(m);
+	  strings dfiles = populate_input_files(dir, schema);
+	  files.insert(files.end(), dfiles.begin(), dfiles.end());
 	}
+    return files;
+  };
 
-      std::cout << url << std::endl;
-    }
-  else
+  std::signal(SIGINT, watch_signal);
+  std::signal(SIGTERM, watch_signal);
+
+  directory_watch watch(idir);
+  std::clog << "watching " << idir << " with " << nthreads << " threads"
+	    << std::endl;
+  queuef(scanf());
+  while (!watch_stop)
     {
-      string m("extract_browsertime_url:: error, cannot find URL field");
-      m +=  " in file: ";
-      m += ifile;
-      m += k::newline;
-      throw std::runtime_error(m);
+      strings files;
+      if (!watch.wait(files, 500))
+	continue;
+      if (watch._M_overflowp)
+	{
+	  std::clog << "watch queue overflow, rescanning " << idir << std::endl;
+	  watch._M_overflowp = false;
+	  files = scanf();
+	}
+      queuef(files);
     }
-}
 
-
-// Main entry point for extraction, meta function dispatch based on @schema.
-void
-extract_identifiers(string idata, string inames, const json_t schema,
-		    const uint deviations = 0)
-{
-  if (schema == json_t::browsertime)
-    extract_browsertime(idata, inames, histogram_view_t::median, deviations);
-  if (schema == json_t::browsertime_log)
-    extract_browsertime_log(idata, inames);
-  if (schema == json_t::browsertime_url)
-    extract_browsertime_url(idata);
-  if (schema == json_t::mozilla_desktop)
-    extract_mozilla_desktop(idata, inames);
-  if (schema == json_t::mozilla_android)
-    extract_mozilla_android(idata, inames);
-  if (schema == json_t::mozilla_glean)
-    extract_mozilla_glean(idata);
+  // Finish queued files, then stop.
+  std::clog << "stopping, finishing queued files" << std::endl;
+  queue.close();
+  for (std::thread& t : workers)
+    t.join();
+  if (cache)
+    cache->save();
 }
 } // namespace moz
 
@@ -1073,20 +1704,125 @@ int main(int argc, char* argv[])
   using namespace rapidjson;
   using namespace moz;
 
+  // Optional input schema, and instrumentation as stage totals or as
+  // a Chrome trace. Take these flags out of argv, before the other
+  // arguments.
+  string schemaname(to_string(json_t::browsertime));
+  string viewname;
+  string quantilename;
+  string tracefile;
+  bool chromep(false);
+  bool cachep(true);
+  int nargs(1);
+  for (int i = 1; i < argc; ++i)
+    {
+      const string arg(argv[i]);
+      if (arg.rfind("--schema=", 0) == 0)
+	schemaname = arg.substr(9);
+      else if (arg.rfind("--view=", 0) == 0)
+	viewname = arg.substr(7);
+      else if (arg.rfind("--quantile=", 0) == 0)
+	quantilename = arg.substr(11);
+      else if (arg.rfind("--stats=", 0) == 0)
+	tracefile = arg.substr(8);
+      else if (arg.rfind("--trace=", 0) == 0)
+	{
+	  tracefile = arg.substr(8);
+	  chromep = true;
+	}
+      else if (arg == "--no-cache")
+	cachep = false;
+      else
+	argv[nargs++] = argv[i];
+    }
+  argc = nargs;
+  trace_session trace(tracefile, chromep);
+
+  json_t schema;
+  histogram_view_t view;
+  try
+    {
+      schema = json_t_from_name(schemaname);
+      view = default_histogram_view(schema);
+      if (!viewname.empty())
+	view = histogram_view_t_from_name(viewname);
+      if (!histogram_view_p(schema, view))
+	throw std::runtime_error(moz::k::errorprefix + "view " + viewname
+				 + " not extracted for schema "
+				 + schemaname);
+      if (!quantilename.empty())
+	{
+	  const double p = std::stod(quantilename);
+	  if (!(p >= 0 && p <= 1))
+	    throw std::runtime_error(moz::k::errorprefix + "quantile "
+				     + quantilename + " not in [0, 1]");
+	  histogram_view_quantile() = p;
+	}
+    }
+  catch (const std::exception& e)
+    {
+      std::cerr << e.what() << std::endl << usage() << std::endl;
+      return 1;
+    }
+
+  // Long-running mode, extract and render new results as they land.
+  if (argc >= 5 && argc <= 6 && string(argv[1]) == "--watch")
+    {
+      const string hilite = argc == 6 ? argv[5] : "VisualComplete95";
+      try
+	{
+	  const edit_list edits(argv[3]);
+	  watch_and_extract(argv[2], argv[3], edits, argv[4], hilite, cachep);
+	}
+      catch (const std::exception& e)
+	{
+	  std::cerr << e.what() << std::endl;
+	  return 12;
+	}
+      return 0;
+    }
+
+  // Merge histograms across many pings.
+  if (argc >= 4 && argc <= 5 && string(argv[1]) == "--aggregate")
+    {
+      const string idata = argv[2];
+      const string ofstem = argc == 5 ? argv[4] : "aggregate";
+      try
+	{
+	  const edit_list edits(argv[3]);
+	  strings files = { idata };
+	  if (filesystem::is_directory(idata))
+	    files = populate_input_files(idata, json_t::mozilla_desktop);
+	  thread_pool pool;
+	  aggregate_histograms(files, edits, ofstem, pool);
+	}
+      catch (const std::exception& e)
+	{
+	  std::cerr << e.what() << std::endl;
+	  return 12;
+	}
+      return 0;
+    }
+
   // Sanity check.
-  if (argc < 2 || argc > 3)
+  if (argc < 2 || argc > 4)
     {
       std::cerr << usage() << std::endl;
       return 1;
     }
 
-  // Input match names file, input JSON data file
+  // Input match names file, input JSON data file or directory
   std::string idata = argv[1];
 
   std::string inames;
-  if (argc == 3)
+  if (argc >= 3)
     inames = argv[2];
 
+  // Optional metric store, appended to with all extracted runs.
+  std::string ostore;
+  if (argc == 4)
+    ostore = argv[3];
+
   bool verbose(false);
   if (verbose)
     {
@@ -1095,16 +1831,54 @@ int main(int argc, char* argv[])
       std::clog << std::endl;
     }
 
+  // Read edit list once.
+  const edit_list edits(inames);
+
   // Extract data/values from json.
   // This is useful for generating a list of Histograms and Scalar probe names.
   //list_json_fields(idata, 0);
   //list_json_fields(idata, 1);
 
-  //extract_identifiers(idata, inames, json_t::browsertime_log);
-  extract_identifiers(idata, inames, json_t::browsertime, 2);
-  //extract_identifiers(idata, inames, json_t::browsertime_url);
+  const uint deviations = 2;
+  try
+    {
+      // Skip inputs unchanged since the last extraction, unless
+      // writing a store, which needs every run, or only printing.
+      std::unique_ptr<metric_store_writer> store;
+      std::unique_ptr<extract_cache> cache;
+      if (!ostore.empty())
+	store = std::make_unique<metric_store_writer>(ostore);
+      else if (cachep && !stdout_schema_p(schema))
+	cache = std::make_unique<extract_cache>();
+
+      const string settings = extract_settings(inames, schema, view,
+					       deviations);
+
+      if (filesystem::is_directory(idata))
+	{
+	  strings files = populate_input_files(idata, schema);
+	  extract_identifiers(files, edits, schema, view, deviations,
+			      store.get(), cache.get(), settings);
+	}
+      else
+	extract_input(idata, edits, schema, view, deviations, store.get(),
+		      cache.get(), settings);
+
+      if (store)
+	store->flush();
+      if (cache)
+	cache->save();
+    }
+  catch (const std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 12;
+    }
+
+  //extract_identifiers(idata, edits, json_t::browsertime_log);
+  //extract_identifiers(idata, edits, json_t::browsertime_url);
 
-  //  extract_identifiers(idata, inames, json_t::har);
+  //  extract_identifiers(idata, edits, json_t::har);
 
   return 0;
 }
@@ -0,0 +1,403 @@
+// mozilla histogram statistics -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_HISTOGRAM_H
+#define moz_X_HISTOGRAM_H 1
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+/**
+   Histogram statistics computed directly from (bucket, count) pairs.
+
+   Each sample in a bucket is taken to have the bucket value, as when
+   the histogram is expanded into a vector of samples, but these
+   functions never do that expansion. Instead, order statistics are
+   found by walking the cumulative count of the sorted buckets, so
+   cost is in the number of buckets, not the number of samples.
+*/
+
+/// Bucket value, and number of samples in the bucket.
+using bucket_t = std::pair<int64_t, int64_t>;
+using buckets_t = std::vector<bucket_t>;
+
+
+/// Sort by bucket value, remove buckets with no samples.
+void
+normalize_buckets(buckets_t& buckets)
+{
+  auto emptyp = [](const bucket_t& b) { return b.second <= 0; };
+  buckets.erase(std::remove_if(buckets.begin(), buckets.end(), emptyp),
+		buckets.end());
+  std::sort(buckets.begin(), buckets.end());
+}
+
+
+/// Total number of samples.
+int64_t
+histogram_count(const buckets_t& buckets)
+{
+  int64_t n(0);
+  for (const auto& [ v, c ] : buckets)
+    n += c;
+  return n;
+}
+
+
+/// Value of the sample at zero-based @rank, in sorted sample order.
+/// Assumes normalized buckets, and 0 <= rank < histogram_count.
+int64_t
+histogram_value_at_rank(const buckets_t& buckets, const int64_t rank)
+{
+  int64_t cumulative(0);
+  for (const auto& [ v, c ] : buckets)
+    {
+      cumulative += c;
+      if (rank < cumulative)
+	return v;
+    }
+  return buckets.empty() ? 0 : buckets.back().first;
+}
+
+
+/// Quantile @p in [0, 1], linearly interpolated between the closest
+/// ranks at p * (n - 1). So 0.5 is the median, as the middle sample
+/// for an odd number of samples, or the average of the two middle
+/// samples for an even number.
+double
+histogram_quantile(const buckets_t& buckets, const double p)
+{
+  const int64_t n = histogram_count(buckets);
+  if (n == 0)
+    return 0;
+
+  const double h = std::clamp(p, 0.0, 1.0) * (n - 1);
+  const int64_t lo = std::floor(h);
+  const int64_t hi = std::min(lo + 1, n - 1);
+  const double vlo = histogram_value_at_rank(buckets, lo);
+  const double vhi = histogram_value_at_rank(buckets, hi);
+  return vlo + (h - lo) * (vhi - vlo);
+}
+
+
+double
+histogram_median(const buckets_t& buckets)
+{ return histogram_quantile(buckets, 0.5); }
+
+
+double
+histogram_mean(const buckets_t& buckets)
+{
+  double sum(0);
+  int64_t n(0);
+  for (const auto& [ v, c ] : buckets)
+    {
+      sum += double(v) * c;
+      n += c;
+    }
+  return n ? sum / n : 0;
+}
+
+
+/// Difference between the largest and smallest sample.
+int64_t
+histogram_range(const buckets_t& buckets)
+{
+  int64_t range(0);
+  if (!buckets.empty())
+    range = buckets.back().first - buckets.front().first;
+  return range;
+}
+
+
+/// Population standard deviation.
+double
+histogram_stddev(const buckets_t& buckets)
+{
+  const double mean = histogram_mean(buckets);
+  double sumsq(0);
+  int64_t n(0);
+  for (const auto& [ v, c ] : buckets)
+    {
+      const double d = v - mean;
+      sumsq += d * d * c;
+      n += c;
+    }
+  return n ? std::sqrt(sumsq / n) : 0;
+}
+
+
+/// Mean absolute deviation from the mean.
+double
+histogram_mdev(const buckets_t& buckets)
+{
+  const double mean = histogram_mean(buckets);
+  double sumabs(0);
+  int64_t n(0);
+  for (const auto& [ v, c ] : buckets)
+    {
+      sumabs += std::abs(v - mean) * c;
+      n += c;
+    }
+  return n ? sumabs / n : 0;
+}
+
+
+
+/**
+   Merged histograms, across many pings.
+
+   Summing bucket counts of the same probe across pings gives the
+   histogram of all samples, so quantiles of the fleet come from the
+   merged histogram, not from averaging per-ping medians. Merging is
+   associative and commutative, so partial results can be merged in
+   any order, as in parallel tree reductions.
+
+   Exponential and linear histograms have a fixed set of buckets,
+   given by the range and bucket count in the ping. Once enough of
+   those are used, counts are kept dense, one per bucket of the
+   layout, and merges are adds. Otherwise, and for other types, counts
+   are kept sparse, as sorted (bucket, count) pairs. Either way, the
+   merged buckets are the same.
+*/
+
+/// Bucket layout of a histogram, as in the ping.
+struct histogram_layout
+{
+  histogram_t	type = histogram_t::count;
+  int64_t	min = 0;
+  int64_t	max = 0;
+  uint		nbuckets = 0;
+
+  bool
+  operator==(const histogram_layout& o) const
+  {
+    return type == o.type && min == o.min && max == o.max
+      && nbuckets == o.nbuckets;
+  }
+
+  /// Buckets fixed by range and count, so a dense form exists.
+  bool
+  densep() const
+  {
+    const bool typep = type == histogram_t::exponential
+      || type == histogram_t::linear;
+    return typep && nbuckets >= 3 && nbuckets <= 10000 && max > min;
+  }
+};
+
+
+/// Lower bound of each bucket of @layout, as computed by Gecko in
+/// base/histogram.cc for exponential and linear histograms.
+std::vector<int64_t>
+histogram_bucket_bounds(const histogram_layout& layout)
+{
+  const uint n = layout.nbuckets;
+  std::vector<int64_t> bounds(n, 0);
+  if (layout.type == histogram_t::exponential)
+    {
+      int64_t current = std::max(layout.min, int64_t(1));
+      bounds[1] = current;
+      const double log_max = std::log(double(layout.max));
+      for (uint i = 2; i < n; ++i)
+	{
+	  const double log_current = std::log(double(current));
+	  const double log_ratio = (log_max - log_current) / (n - i);
+	  const int64_t next = std::floor(std::exp(log_current + log_ratio)
+					  + 0.5);
+	  current = next > current ? next : current + 1;
+	  bounds[i] = current;
+	}
+    }
+  else
+    {
+      for (uint i = 1; i < n; ++i)
+	{
+	  const double linear = double(layout.min * (n - 1 - i)
+				       + layout.max * (i - 1)) / (n - 2);
+	  bounds[i] = linear + 0.5;
+	}
+    }
+  return bounds;
+}
+
+
+/// Merge sorted @a and sorted @b, adding counts of the same bucket.
+buckets_t
+merge_buckets(const buckets_t& a, const buckets_t& b)
+{
+  buckets_t ret;
+  ret.reserve(a.size() + b.size());
+  auto i = a.begin();
+  auto j = b.begin();
+  while (i != a.end() || j != b.end())
+    {
+      const bool ip = j == b.end() || (i != a.end() && i->first <= j->first);
+      const bucket_t& next = ip ? *i++ : *j++;
+      if (!ret.empty() && ret.back().first == next.first)
+	ret.back().second += next.second;
+      else
+	ret.push_back(next);
+    }
+  return ret;
+}
+
+
+/// Histogram accumulated over many pings.
+struct histogram_accumulator
+{
+  histogram_layout	_M_layout;
+  std::vector<int64_t>	_M_bounds;	// Dense bucket lower bounds, or empty.
+  std::vector<int64_t>	_M_counts;	// Dense counts, one per bound.
+  buckets_t		_M_sparse;	// Sparse (bucket, count), sorted.
+  int64_t		_M_sum = 0;
+  uint			_M_npings = 0;
+
+  bool
+  densep() const
+  { return !_M_bounds.empty(); }
+
+  bool
+  empty() const
+  { return _M_npings == 0; }
+
+  /// Add one ping's normalized @buckets, with @layout and @sum.
+  void
+  add(const histogram_layout& layout, const buckets_t& buckets,
+      const int64_t sum)
+  {
+    histogram_accumulator one;
+    one._M_layout = layout;
+    one._M_sparse = merge_buckets(buckets, { });
+    one._M_sum = sum;
+    one._M_npings = 1;
+    merge(one);
+  }
+
+  void
+  merge(const histogram_accumulator& o)
+  {
+    if (o.empty())
+      return;
+    if (empty())
+      {
+	*this = o;
+	try_dense();
+	return;
+      }
+
+    _M_sum += o._M_sum;
+    _M_npings += o._M_npings;
+    if (!(_M_layout == o._M_layout))
+      {
+	// Layout changed between pings, keep by bucket value only.
+	to_sparse();
+	_M_layout.nbuckets = 0;
+	_M_sparse = merge_buckets(_M_sparse, o.buckets());
+	return;
+      }
+
+    if (densep() && o.densep())
+      {
+	for (uint i = 0; i < _M_counts.size(); ++i)
+	  _M_counts[i] += o._M_counts[i];
+      }
+    else if (densep())
+      {
+	if (!add_dense(o._M_sparse))
+	  _M_sparse = merge_buckets(_M_sparse, o._M_sparse);
+      }
+    else
+      {
+	_M_sparse = merge_buckets(_M_sparse, o.buckets());
+	try_dense();
+      }
+  }
+
+  /// Merged buckets, normalized.
+  buckets_t
+  buckets() const
+  {
+    if (!densep())
+      return _M_sparse;
+
+    buckets_t ret;
+    for (uint i = 0; i < _M_counts.size(); ++i)
+      if (_M_counts[i] > 0)
+	ret.emplace_back(_M_bounds[i], _M_counts[i]);
+    return ret;
+  }
+
+private:
+  /// Add sparse @b to dense counts, false if a bucket is not in layout.
+  bool
+  add_dense(const buckets_t& b)
+  {
+    std::vector<uint> idx;
+    idx.reserve(b.size());
+    for (const auto& [ v, c ] : b)
+      {
+	auto i = std::lower_bound(_M_bounds.begin(), _M_bounds.end(), v);
+	if (i == _M_bounds.end() || *i != v)
+	  {
+	    to_sparse();
+	    _M_layout.nbuckets = 0;
+	    return false;
+	  }
+	idx.push_back(i - _M_bounds.begin());
+      }
+    for (uint j = 0; j < b.size(); ++j)
+      _M_counts[idx[j]] += b[j].second;
+    return true;
+  }
+
+  /// Go dense when a quarter of the layout's buckets are used.
+  void
+  try_dense()
+  {
+    if (densep() || !_M_layout.densep()
+	|| _M_sparse.size() * 4 < _M_layout.nbuckets)
+      return;
+
+    _M_bounds = histogram_bucket_bounds(_M_layout);
+    _M_counts.assign(_M_bounds.size(), 0);
+    buckets_t sparse;
+    sparse.swap(_M_sparse);
+    if (!add_dense(sparse))
+      _M_sparse = std::move(sparse);
+  }
+
+  void
+  to_sparse()
+  {
+    if (densep())
+      {
+	_M_sparse = buckets();
+	_M_bounds.clear();
+	_M_counts.clear();
+      }
+  }
+};
+
+} // namespace moz
+#endif
@@ -0,0 +1,224 @@
+// mozilla InfluxDB line protocol export -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_INFLUX_H
+#define moz_X_INFLUX_H 1
+
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "moz-perf-x-csv.h"
+#include "moz-perf-x-compress.h"
+
+
+namespace moz {
+
+/**
+   Extracted CSV rows to InfluxDB line protocol, one point per row:
+
+   metric,device=D,product=P,url=U value=V,stddev=S,mdev=M timestamp
+
+   Timestamps are in seconds, so write with precision=s.
+   See https://docs.influxdata.com/influxdb/v2.0/reference/syntax/line-protocol/
+*/
+
+/// Tags common to all points from one input file.
+struct influx_tags
+{
+  string	device;
+  string	product;
+  string	url;
+};
+
+
+/// Append @s to @out, with backslash before any of @special.
+void
+append_influx_escaped(string& out, std::string_view s, const char* special)
+{
+  for (const char c : s)
+    {
+      if (std::strchr(special, c))
+	out += '\\';
+      out += c;
+    }
+}
+
+
+void
+append_influx_field(string& out, const char* key, const double d)
+{
+  char buf[32];
+  auto [ end, ec ] = std::to_chars(buf, buf + sizeof(buf), d);
+  out += key;
+  out += '=';
+  out.append(buf, ec == std::errc() ? end - buf : 0);
+}
+
+
+/// Append one point for @row to @out, with @tags and @timestamp.
+void
+append_influx_point(string& out, const csv_row& row, const influx_tags& tags,
+		    const int64_t timestamp)
+{
+  append_influx_escaped(out, row.name, ", ");
+
+  const std::pair<const char*, const string&> tagv[] =
+    { { "device", tags.device }, { "product", tags.product },
+      { "url", tags.url } };
+  for (const auto& [ key, value ] : tagv)
+    {
+      // Empty tag values are not allowed.
+      if (!value.empty())
+	{
+	  out += k::comma;
+	  out += key;
+	  out += '=';
+	  append_influx_escaped(out, value, ",= ");
+	}
+    }
+
+  out += k::space;
+  append_influx_field(out, "value", row.value);
+  if (row.nfields >= 3)
+    {
+      out += k::comma;
+      append_influx_field(out, "stddev", row.stddev);
+    }
+  if (row.nfields >= 4)
+    {
+      out += k::comma;
+      append_influx_field(out, "mdev", row.mdev);
+    }
+
+  out += k::space;
+  out += to_string(timestamp);
+  out += k::newline;
+}
+
+
+/// Seconds since the epoch for ISO 8601 @stamp, as in browsertime
+/// info.timestamp: 2021-03-31T12:00:01.234Z or 2021-03-31T12:00:01+00:00.
+/// Returns zero if @stamp cannot be parsed.
+int64_t
+iso_timestamp_to_seconds(const string& stamp)
+{
+  std::tm tm = { };
+  const char* rest = strptime(stamp.c_str(), "%Y-%m-%dT%H:%M:%S", &tm);
+  if (!rest)
+    return 0;
+  int64_t secs = timegm(&tm);
+
+  // Skip fractional seconds, then apply any UTC offset.
+  if (*rest == '.')
+    while (std::isdigit(*++rest));
+  if (*rest == '+' || *rest == '-')
+    {
+      int hh(0), mm(0);
+      if (std::sscanf(rest + 1, "%2d:%2d", &hh, &mm) >= 1)
+	{
+	  const int64_t offset = hh * 3600 + mm * 60;
+	  secs += *rest == '+' ? -offset : offset;
+	}
+    }
+  return secs;
+}
+
+
+/**
+   Batches of line protocol points, written @batch_points at a time.
+
+   Each batch is written either to stdout, if @ofstem is "-", or to a
+   numbered file ofstem.N.lp, and is optionally compressed with gzip
+   (then ofstem.N.lp.gz), ready to be sent as the body of one write
+   request with "Content-Encoding: gzip".
+*/
+struct influx_sink
+{
+  const string	_M_ofstem;
+  const size_t	_M_batch_points;
+  const bool	_M_gzipp;
+
+  string	_M_batch;
+  size_t	_M_npoints;
+  size_t	_M_ntotal;
+  strings	_M_files;
+
+  influx_sink(const string& ofstem, const size_t batch_points = 5000,
+	      const bool gzipp = true)
+  : _M_ofstem(ofstem), _M_batch_points(std::max(batch_points, size_t(1))),
+    _M_gzipp(gzipp), _M_npoints(0), _M_ntotal(0)
+  { }
+
+  influx_sink(const influx_sink&) = delete;
+  influx_sink& operator=(const influx_sink&) = delete;
+
+  ~influx_sink()
+  {
+    try
+      {
+	flush();
+      }
+    catch (const std::exception& e)
+      {
+	std::cerr << e.what() << std::endl;
+      }
+  }
+
+  void
+  add(const csv_row& row, const influx_tags& tags, const int64_t timestamp)
+  {
+    append_influx_point(_M_batch, row, tags, timestamp);
+    ++_M_ntotal;
+    if (++_M_npoints == _M_batch_points)
+      flush();
+  }
+
+  /// Write out the current batch, if any.
+  void
+  flush()
+  {
+    if (_M_npoints == 0)
+      return;
+
+    const string body = _M_gzipp ? compress_gzip(_M_batch) : _M_batch;
+    if (_M_ofstem == "-")
+      {
+	std::cout.write(body.data(), body.size());
+	std::cout.flush();
+      }
+    else
+      {
+	string ext('.' + to_string(_M_files.size()) + ".lp");
+	if (_M_gzipp)
+	  ext += ".gz";
+	ofstream ofs(make_data_file(_M_ofstem, ext, std::ios_base::binary));
+	ofs.write(body.data(), body.size());
+	if (!ofs.good())
+	  throw std::runtime_error(k::errorprefix + "influx_sink:: write "
+				   + _M_ofstem + ext);
+	_M_files.push_back(_M_ofstem + ext);
+      }
+
+    _M_batch.clear();
+    _M_npoints = 0;
+  }
+};
+
+} // namespace moz
+#endif
@@ -0,0 +1,421 @@
+// mozilla streaming (SAX) JSON extraction -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_JSON_STREAM_H
+#define moz_X_JSON_STREAM_H 1
+
+#include <cstdio>
+#include <utility>
+
+#include "rapidjson/writer.h"
+
+#include "moz-perf-x-json.h"
+
+
+namespace moz {
+
+/// Kind of node found at the end of a stream_target path.
+enum class stream_node_t
+{
+  histogram,	// parent object of histogram probes
+  scalar,	// parent object of scalar probes
+  subtree	// one node, materialized whole
+};
+
+
+/// Path of object keys from the document root to a node of interest,
+/// like a JSON pointer /payload/processes/content/histograms.
+struct stream_target
+{
+  strings		path;
+  stream_node_t		kind;
+};
+
+using stream_targets = std::vector<stream_target>;
+
+
+/**
+   SAX handler for rj::Reader that tracks the current path through
+   the document, and only materializes the nodes that match a
+   stream_target. For histogram and scalar targets, these are the
+   child nodes named in the probe index. Each matching node is
+   re-serialized into a buffer as it is read, and kept as JSON text
+   at the end of the node, to be parsed and reduced to a value after
+   the stream ends. So, memory use grows with the probes in the edit
+   list, not with the size of the input document.
+
+   Captures are indexed by target, in the same order as the targets,
+   and then in document order. A probe may be captured from more than
+   one target: which one it is taken from is up to the reduction.
+*/
+struct probe_stream_handler
+{
+  /// Probe name and its node, as JSON text.
+  using capture = std::pair<string, string>;
+  using captures = std::vector<capture>;
+
+  struct frame
+  {
+    bool	arrayp;
+    string	key;
+    uint	index;
+  };
+
+  const stream_targets&		_M_targets;
+  const probe_index&		_M_probes;
+
+  // Current path, one frame per open object or array.
+  std::vector<frame>		_M_path;
+
+  // Current capture state, if any.
+  std::vector<uint>		_M_capture;
+  string			_M_capture_probe;
+  uint				_M_depth;
+  rj::StringBuffer		_M_buffer;
+  rj::Writer<rj::StringBuffer>	_M_writer;
+
+  // Results, indexed by target.
+  std::vector<captures>		_M_captures;
+  strings			_M_subtrees;
+  std::vector<bool>		_M_seen;
+
+  probe_stream_handler(const stream_targets& targets,
+		       const probe_index& probes)
+  : _M_targets(targets), _M_probes(probes), _M_depth(0),
+    _M_writer(_M_buffer), _M_captures(targets.size()),
+    _M_subtrees(targets.size()), _M_seen(targets.size(), false)
+  { }
+
+  /// Current path is exactly @path plus @extra trailing frames.
+  bool
+  path_matches(const strings& path, const uint extra) const
+  {
+    if (_M_path.size() != path.size() + extra)
+      return false;
+    for (uint i = 0; i < path.size(); ++i)
+      {
+	const frame& f = _M_path[i];
+	if (f.arrayp || f.key != path[i])
+	  return false;
+      }
+    return true;
+  }
+
+  /// At the start of a value, begin capture if it matches a target.
+  void
+  begin_value()
+  {
+    for (uint t = 0; t < _M_targets.size(); ++t)
+      {
+	const stream_target& target = _M_targets[t];
+	if (target.kind == stream_node_t::subtree)
+	  {
+	    if (path_matches(target.path, 0))
+	      {
+		_M_seen[t] = true;
+		_M_capture.push_back(t);
+	      }
+	  }
+	else if (path_matches(target.path, 0))
+	  _M_seen[t] = true;
+	else if (path_matches(target.path, 1) && !_M_path.back().arrayp)
+	  {
+	    const string& key = _M_path.back().key;
+	    bool probep = _M_probes.find(key) != probe_index::npos;
+	    if (probep)
+	      {
+		_M_capture_probe = key;
+		_M_capture.push_back(t);
+	      }
+	  }
+      }
+
+    if (!_M_capture.empty())
+      {
+	_M_buffer.Clear();
+	_M_writer.Reset(_M_buffer);
+	_M_depth = 0;
+      }
+  }
+
+  /// At the end of a value, advance index if in an array.
+  void
+  end_value()
+  {
+    if (!_M_path.empty() && _M_path.back().arrayp)
+      ++_M_path.back().index;
+  }
+
+  /// At the end of a captured node, keep it for each target.
+  void
+  end_capture()
+  {
+    const string json(_M_buffer.GetString(), _M_buffer.GetSize());
+    for (const uint t : _M_capture)
+      {
+	if (_M_targets[t].kind == stream_node_t::subtree)
+	  _M_subtrees[t] = json;
+	else
+	  _M_captures[t].emplace_back(_M_capture_probe, json);
+      }
+    _M_capture.clear();
+  }
+
+  template<typename _Fn>
+  bool
+  scalar(_Fn fn)
+  {
+    if (_M_capture.empty())
+      begin_value();
+    if (!_M_capture.empty())
+      {
+	fn(_M_writer);
+	if (_M_depth == 0)
+	  {
+	    end_capture();
+	    end_value();
+	  }
+      }
+    else
+      end_value();
+    return true;
+  }
+
+  bool
+  start_container(const bool arrayp)
+  {
+    if (_M_capture.empty())
+      begin_value();
+    if (!_M_capture.empty())
+      {
+	++_M_depth;
+	return arrayp ? _M_writer.StartArray() : _M_writer.StartObject();
+      }
+    _M_path.push_back(frame { arrayp, string(), 0 });
+    return true;
+  }
+
+  bool
+  end_container(const bool arrayp, rj::SizeType n)
+  {
+    if (!_M_capture.empty())
+      {
+	arrayp ? _M_writer.EndArray(n) : _M_writer.EndObject(n);
+	if (--_M_depth == 0)
+	  {
+	    end_capture();
+	    end_value();
+	  }
+      }
+    else
+      {
+	_M_path.pop_back();
+	end_value();
+      }
+    return true;
+  }
+
+  // rj::Reader handler interface.
+  bool
+  Null()
+  { return scalar([](auto& w) { w.Null(); }); }
+
+  bool
+  Bool(bool b)
+  { return scalar([b](auto& w) { w.Bool(b); }); }
+
+  bool
+  Int(int i)
+  { return scalar([i](auto& w) { w.Int(i); }); }
+
+  bool
+  Uint(unsigned u)
+  { return scalar([u](auto& w) { w.Uint(u); }); }
+
+  bool
+  Int64(int64_t i)
+  { return scalar([i](auto& w) { w.Int64(i); }); }
+
+  bool
+  Uint64(uint64_t u)
+  { return scalar([u](auto& w) { w.Uint64(u); }); }
+
+  bool
+  Double(double d)
+  { return scalar([d](auto& w) { w.Double(d); }); }
+
+  bool
+  RawNumber(const char* s, rj::SizeType len, bool copy)
+  { return scalar([=](auto& w) { w.RawNumber(s, len, copy); }); }
+
+  bool
+  String(const char* s, rj::SizeType len, bool copy)
+  { return scalar([=](auto& w) { w.String(s, len, copy); }); }
+
+  bool
+  StartObject()
+  { return start_container(false); }
+
+  bool
+  Key(const char* s, rj::SizeType len, bool copy)
+  {
+    if (!_M_capture.empty())
+      return _M_writer.Key(s, len, copy);
+    _M_path.back().key.assign(s, len);
+    return true;
+  }
+
+  bool
+  EndObject(rj::SizeType n)
+  { return end_container(false, n); }
+
+  bool
+  StartArray()
+  { return start_container(true); }
+
+  bool
+  EndArray(rj::SizeType n)
+  { return end_container(true, n); }
+};
+
+
+/**
+   Input stream for rj::Reader that decompresses xz input in
+   fixed-size chunks, so that the whole decompressed document is
+   never in memory at once.
+*/
+struct xz_read_stream
+{
+  typedef char Ch;
+
+  xz_reader&	_M_xz;
+  char		_M_buffer[65536];
+  char*		_M_cur;
+  char*		_M_end;
+  size_t	_M_count;
+
+  explicit
+  xz_read_stream(xz_reader& xz) : _M_xz(xz), _M_count(0)
+  { fill(); }
+
+  void
+  fill()
+  {
+    _M_cur = _M_buffer;
+    _M_end = _M_buffer + _M_xz.read(_M_buffer, sizeof(_M_buffer));
+  }
+
+  Ch
+  Peek() const
+  { return _M_cur != _M_end ? *_M_cur : '\0'; }
+
+  Ch
+  Take()
+  {
+    Ch c = Peek();
+    if (_M_cur != _M_end)
+      {
+	++_M_count;
+	if (++_M_cur == _M_end)
+	  fill();
+      }
+    return c;
+  }
+
+  size_t
+  Tell() const
+  { return _M_count; }
+
+  // Not implemented, output stream interface.
+  Ch* PutBegin() { RAPIDJSON_ASSERT(false); return 0; }
+  void Put(Ch) { RAPIDJSON_ASSERT(false); }
+  void Flush() { RAPIDJSON_ASSERT(false); }
+  size_t PutEnd(Ch*) { RAPIDJSON_ASSERT(false); return 0; }
+};
+
+
+template<typename _Stream, typename _Handler>
+bool
+stream_json(_Stream& is, _Handler& h, const string& ifile)
+{
+  scoped_timer timer("parse", ifile);
+  rj::Reader reader;
+  rj::ParseResult ok = reader.Parse(is, h);
+  timer.count("bytes_read", is.Tell());
+  if (!ok)
+    {
+      std::cerr << "error: cannot parse JSON file " << ifile << std::endl;
+      std::cerr << rj::GetParseError_En(ok.Code()) << std::endl;
+      std::cerr << ok.Offset() << std::endl;
+    }
+  return ok;
+}
+
+
+/// Stream decompressed input @buffer, named @ifile, through SAX handler @h.
+template<typename _Handler>
+bool
+stream_json_buffer(const std::vector<char>& buffer, _Handler& h,
+		   const string& ifile)
+{
+  rj::StringStream is(buffer.data());
+  return stream_json(is, h, ifile);
+}
+
+
+/// Stream input file @ifile through SAX handler @h, in fixed-size chunks.
+/// Input compressed with xz is decompressed chunk by chunk, mozLz4
+/// input is a single LZ4 block and so is decompressed all at once.
+template<typename _Handler>
+bool
+stream_json_file(const string& ifile, _Handler& h)
+{
+  std::FILE* fp = std::fopen(ifile.c_str(), "r");
+  if (!fp)
+    {
+      ostringstream mss;
+      mss << k::errorprefix << "stream_json_file:: "
+	  << "cannot open input file: "
+	  << ifile << std::endl;
+      throw std::runtime_error(mss.str());
+    }
+
+  // Sniff for compressed input.
+  char magic[16];
+  const size_t nmagic = std::fread(magic, 1, sizeof(magic), fp);
+  if (mozlz4_p(magic, nmagic) || xz_p(magic, nmagic))
+    {
+      std::fclose(fp);
+      mapped_file mf(ifile);
+      if (mozlz4_p(mf.data(), mf.size()))
+	return stream_json_buffer(decompress_mozlz4(mf.data(), mf.size()),
+				  h, ifile);
+      xz_reader xz(mf.data(), mf.size());
+      xz_read_stream is(xz);
+      return stream_json(is, h, ifile);
+    }
+  std::rewind(fp);
+
+  char buffer[65536];
+  rj::FileReadStream is(fp, buffer, sizeof(buffer));
+  bool ok = stream_json(is, h, ifile);
+  std::fclose(fp);
+  return ok;
+}
+
+} // namespace moz
+#endif
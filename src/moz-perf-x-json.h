@@ -28,6 +28,9 @@
 #include "rapidjson/reader.h"
 
 #include "moz-perf-x.h"
+#include "moz-perf-x-compress.h"
+#include "moz-perf-x-histogram.h"
+#include "moz-perf-x-trace.h"
 
 
 namespace moz {
@@ -36,6 +39,7 @@ namespace moz {
     const std::string s2 = "histogram-sanity-check-multi";
     static std::ofstream ofssinglev = make_log_file(s1);
     static std::ofstream ofsmultiv = make_log_file(s2);
+    static std::mutex ofsmutex;
   } // anonymous namespace
 } // namespace moz
 
@@ -56,6 +60,35 @@ const char* kTypeNames[] =
 { "Null", "False", "True", "Object", "Array", "String", "Number" };
 
 
+/// Allocator for DOMs of nested JSON, shared for all nodes from one file.
+using json_pool = rj::MemoryPoolAllocator<>;
+
+
+/**
+   Parse JSON stringified in string value @v in place, without a copy,
+   with DOM nodes taken from @pool.
+
+   The string storage of @v belongs to its document, and is
+   overwritten, so @v cannot be used after. This needs writable
+   storage, as from json_dom, or any document not parsed from
+   read-only memory. The returned DOM is valid as long as both @pool
+   and the document of @v are.
+*/
+rj::Document
+parse_stringified_json_to_dom(const rj::Value& v, json_pool& pool)
+{
+  rj::Document dom(&pool);
+  dom.ParseInsitu(const_cast<char*>(v.GetString()));
+  if (dom.HasParseError())
+    {
+      std::cerr << "error: cannot parse JSON string" << std::endl;
+      std::cerr << rj::GetParseError_En(dom.GetParseError()) << std::endl;
+      std::cerr << dom.GetErrorOffset() << std::endl;
+    }
+  return dom;
+}
+
+
 rj::Document
 parse_stringified_json_to_dom(string stringified)
 {
@@ -71,29 +104,113 @@ parse_stringified_json_to_dom(string stringified)
 }
 
 
-rj::Document
-deserialize_json_to_dom(string input_file)
+/**
+   DOM parsed in situ from a memory mapped input file, or from a
+   buffer holding decompressed input.
+
+   String values in the DOM point directly into the mapping or buffer
+   instead of being copied, so that storage is owned by and lives as
+   long as the DOM. Use in place of rj::Document, as converting to a
+   plain rj::Document will leave it with dangling string values.
+*/
+struct json_dom : public rj::Document
 {
-  // Deserialize input file.
-  std::ifstream ifs(input_file);
-  string json;
-  if (ifs.good())
+  mapped_file		_M_file;
+  std::vector<char>	_M_buffer;
+
+  json_dom() = default;
+  json_dom(json_dom&&) = default;
+
+  /// Parse null-terminated @ifile in place, taking ownership.
+  void
+  parse_insitu(mapped_file&& ifile)
+  {
+    _M_file = std::move(ifile);
+    ParseInsitu(_M_file.data());
+  }
+
+  /// Parse null-terminated @buffer in place, taking ownership.
+  void
+  parse_insitu(std::vector<char>&& buffer)
+  {
+    _M_buffer = std::move(buffer);
+    ParseInsitu(_M_buffer.data());
+  }
+};
+
+
+/// Number of values in DOM @v, including @v.
+uint64_t
+count_dom_nodes(const rj::Value& v)
+{
+  uint64_t n(1);
+  if (v.IsObject())
+    for (vcmem_iterator i = v.MemberBegin(); i != v.MemberEnd(); ++i)
+      n += count_dom_nodes(i->value);
+  if (v.IsArray())
+    for (vcval_iterator i = v.Begin(); i != v.End(); ++i)
+      n += count_dom_nodes(*i);
+  return n;
+}
+
+
+void
+report_parse_error(const json_dom& dom, const string& input_file)
+{
+  if (dom.HasParseError())
     {
-      std::ostringstream oss;
-      oss << ifs.rdbuf();
-      json = oss.str();
+      std::cerr << "error: cannot parse JSON file " << input_file << std::endl;
+      std::cerr << rj::GetParseError_En(dom.GetParseError()) << std::endl;
+      std::cerr << dom.GetErrorOffset() << std::endl;
     }
+}
+
+
+/// Parse input @buffer, as from a tar archive member, with a trailing
+/// null. An xz compressed member, as name.json.xz, is decompressed
+/// first, to a buffer that also ends in a null.
+json_dom
+deserialize_json_to_dom(std::vector<char>&& buffer, const string& name)
+{
+  scoped_timer timer("parse", name);
+  timer.count("bytes_read", buffer.size());
+
+  json_dom dom;
+  const size_t n = buffer.empty() ? 0 : buffer.size() - 1;
+  if (xz_p(buffer.data(), n))
+    dom.parse_insitu(decompress_xz(buffer.data(), n));
   else
-    {
-      ostringstream mss;
-      mss<< k::errorprefix << "deserialize_jason_to_dom:: "
-	      << "cannot open input file: "
-	      << input_file << std::endl;
-      throw std::runtime_error(mss.str());
-    }
+    dom.parse_insitu(std::move(buffer));
+  report_parse_error(dom, name);
+  if (timer.enabledp())
+    timer.count("dom_nodes", count_dom_nodes(dom));
+  return dom;
+}
 
-  // Validate json file, or parse immediately and report error?
-  return parse_stringified_json_to_dom(json);
+
+json_dom
+deserialize_json_to_dom(string input_file)
+{
+  // Map input file, throws if it cannot be opened.
+  scoped_timer timer("parse", input_file);
+  mapped_file ifile(input_file);
+  timer.count("bytes_read", ifile.size());
+
+  // Parse in place, no copies of the input file or string values.
+  // Compressed input is decompressed straight to the parse buffer.
+  json_dom dom;
+  const char* data = ifile.data();
+  const size_t n = ifile.size();
+  if (mozlz4_p(data, n))
+    dom.parse_insitu(decompress_mozlz4(data, n));
+  else if (xz_p(data, n))
+    dom.parse_insitu(decompress_xz(data, n));
+  else
+    dom.parse_insitu(std::move(ifile));
+  report_parse_error(dom, input_file);
+  if (timer.enabledp())
+    timer.count("dom_nodes", count_dom_nodes(dom));
+  return dom;
 }
 
 
@@ -140,6 +257,126 @@ deserialize_file_to_strings(string inames)
 }
 
 
+/**
+   Index of probe names to match against field names in a JSON file,
+   built once from an edit list.
+
+   Names are sorted and numbered in that order, and a hash table maps
+   each name to its id. Which probes have been found during one
+   extraction is kept separately in a probe_matches bitset, so that
+   the index itself is read-only and can be shared.
+*/
+struct probe_index
+{
+  static constexpr uint npos = uint(-1);
+
+  strings					_M_names;
+  std::unordered_map<std::string_view, uint>	_M_ids;
+
+  probe_index() = default;
+
+  explicit
+  probe_index(strings names) : _M_names(std::move(names))
+  {
+    std::sort(_M_names.begin(), _M_names.end());
+    _M_ids.reserve(_M_names.size());
+    for (uint i = 0; i < _M_names.size(); ++i)
+      _M_ids.emplace(_M_names[i], i);
+  }
+
+  // Keys are views into _M_names.
+  probe_index(const probe_index&) = delete;
+  probe_index& operator=(const probe_index&) = delete;
+
+  uint
+  find(std::string_view name) const
+  {
+    auto i = _M_ids.find(name);
+    return i != _M_ids.end() ? i->second : npos;
+  }
+
+  const string&
+  operator[](const uint id) const
+  { return _M_names[id]; }
+
+  uint
+  size() const
+  { return _M_names.size(); }
+
+  bool
+  empty() const
+  { return _M_names.empty(); }
+};
+
+
+/// Found/remaining accounting for one extraction against a probe_index.
+struct probe_matches
+{
+  const probe_index&		_M_index;
+  std::vector<uint64_t>		_M_bits;
+  uint				_M_nfound;
+
+  explicit
+  probe_matches(const probe_index& index)
+  : _M_index(index), _M_bits((index.size() + 63) / 64, 0), _M_nfound(0)
+  { }
+
+  bool
+  test(const uint id) const
+  { return _M_bits[id / 64] & (uint64_t(1) << (id % 64)); }
+
+  void
+  set(const uint id)
+  {
+    uint64_t& word = _M_bits[id / 64];
+    const uint64_t bit = uint64_t(1) << (id % 64);
+    if (!(word & bit))
+      {
+	word |= bit;
+	++_M_nfound;
+      }
+  }
+
+  uint
+  found_size() const
+  { return _M_nfound; }
+
+  uint
+  remain_size() const
+  { return _M_index.size() - _M_nfound; }
+
+  /// Probe names not yet found, in sorted order.
+  strings
+  remain() const
+  {
+    strings ret;
+    for (uint id = 0; id < _M_index.size(); ++id)
+      if (!test(id))
+	ret.push_back(_M_index[id]);
+    return ret;
+  }
+};
+
+
+/// Edit list input file, and index of the probe names in it. Read
+/// once, and then shared read-only between extractions.
+struct edit_list
+{
+  string	_M_file;
+  probe_index	_M_probes;
+
+  explicit
+  edit_list(const string& inames = "")
+  : _M_file(inames), _M_probes(deserialize_file_to_strings(inames))
+  { }
+};
+
+
+std::string_view
+to_string_view(const rj::Value& v)
+{ return std::string_view(v.GetString(), v.GetStringLength()); }
+
+
 int
 field_value_to_int(const rj::Value& v)
 {
@@ -169,79 +406,149 @@ field_value_to_string(const rj::Value& v)
 }
 
 
+// Histogram node @vh is the value of the histogram named @probe.
 string
-extract_histogram_field_sum(const rj::Value& v, const string& probe)
+extract_histogram_node_sum(const rj::Value& vh, const string&)
 {
-  string found;
-  auto i = v.FindMember(probe.c_str());
-  if (i != v.MemberEnd())
-    {
-      const rj::Value& nv = i->value["sum"];
-      found = field_value_to_string(nv);
-    }
-  return found;
+  const rj::Value& nv = vh["sum"];
+  return field_value_to_string(nv);
 }
 
 
-// Mean is the sum of the histogram values divided by the number of
-// values.
-string
-extract_histogram_field_mean(const rj::Value& v, const string& probe)
+/*
+   Get (value, count) for each non-empty bucket of histogram node @vh,
+   sorted by value. Set @nentries to the number of bucket entries,
+   including the empty ones.
+
+   Categorical and keyed histogram bucket names are not values, so
+   these return no buckets.
+*/
+buckets_t
+extract_histogram_buckets(const rj::Value& vh, uint& nentries)
 {
-  string found;
-  auto i = v.FindMember(probe.c_str());
-  if (i != v.MemberEnd())
+  buckets_t buckets;
+  nentries = 0;
+
+  // Get histogram type.
+  const rj::Value& vht = vh["histogram_type"];
+  histogram_t htype = static_cast<histogram_t>(field_value_to_int(vht));
+  bool htypecp = htype == histogram_t::categorical;
+  bool htypekp = htype == histogram_t::keyed;
+
+  // Get (value, count) for each bucket, in the form of (string, int).
+  const rj::Value& vvs = vh["values"];
+  if (vvs.IsObject())
     {
-      // Get histogram type.
-      const rj::Value& vht = i->value["histogram_type"];
-      histogram_t htype = static_cast<histogram_t>(field_value_to_int(vht));
-      bool htypecp = htype == histogram_t::categorical;
-      bool htypekp = htype == histogram_t::keyed;
-
-      // Get number of buckets.
-      const rj::Value& vbcount = i->value["bucket_count"];
-      int bcount [[gnu::unused]] = field_value_to_int(vbcount);
-
-      // Get sum.
-      const rj::Value& vsum = i->value["sum"];
-      int sum = field_value_to_int(vsum);
-
-      // Get (value, count) for each bucket, in the form of (string, int).
-      const rj::Value& vvs = i->value["values"];
-      if (vvs.IsObject())
+      buckets.reserve(vvs.MemberCount());
+      for (vcmem_iterator j = vvs.MemberBegin(); j != vvs.MemberEnd(); ++j)
 	{
-	  // Iterate through object.
-	  int sumcomputed(0);
-	  int nvalues(0);
-	  for (vcmem_iterator j = vvs.MemberBegin(); j != vvs.MemberEnd(); ++j)
-	    {
-	      const rj::Value& vbktcount = j->value;
-	      int bktcount = field_value_to_int(vbktcount);
-	      nvalues += bktcount;
+	  const rj::Value& vbktcount = j->value;
+	  int bktcount = field_value_to_int(vbktcount);
 
-	      if (!htypecp && !htypekp)
-		{
-		  // For "most" histograms, the name of the bucket
-		  // corresponds to a particular value. So, convert the
-		  // buck name above to an int value.
-		  string bktname = j->name.GetString();
-		  int bktv(std::stoi(bktname));
-		  sumcomputed += (bktv * bktcount);
-		}
-	    }
-
-	  // Sanity check computed sum matches extracted sum.
-	  if (sumcomputed != sum || htypecp || htypekp)
+	  if (bktcount != 0 && !htypecp && !htypekp)
 	    {
-	      std::clog << k::errorprefix << "computed sum of " << sumcomputed
-			<< " != extracted sum of " << sum << std::endl;
+	      // For "most" histograms, the name of the bucket
+	      // corresponds to a particular value. So, convert the
+	      // buck name above to an int value.
+	      std::string_view bktname = to_string_view(j->name);
+	      int64_t bktv(0);
+	      std::from_chars(bktname.data(), bktname.data() + bktname.size(),
+			      bktv);
+	      buckets.emplace_back(bktv, bktcount);
 	    }
 
-	  double mean(sum / nvalues);
-	  found = to_string(mean);
+	  ++nentries;
+	}
+      normalize_buckets(buckets);
+
+      // Samples, as if the histogram were expanded to a vector.
+      if (trace_recorder::enabledp())
+	{
+	  trace_count("histogram", "buckets", buckets.size());
+	  trace_count("histogram", "samples", histogram_count(buckets));
 	}
     }
-  return found;
+  return buckets;
+}
+
+
+/// Bucket layout of histogram node @vh, from its type, range, and
+/// bucket count.
+histogram_layout
+extract_histogram_layout(const rj::Value& vh)
+{
+  histogram_layout layout;
+  const int htype = field_value_to_int(vh["histogram_type"]);
+  layout.type = static_cast<histogram_t>(htype);
+  layout.nbuckets = std::max(0, field_value_to_int(vh["bucket_count"]));
+  auto i = vh.FindMember("range");
+  if (i != vh.MemberEnd() && i->value.IsArray() && i->value.Size() == 2)
+    {
+      const rj::Value* range = i->value.Begin();
+      layout.min = field_value_to_int(range[0]);
+      layout.max = field_value_to_int(range[1]);
+    }
+  return layout;
+}
+
+
+/**
+   Lines for the histogram sanity check logs, held back to be written
+   in a fixed order. Used when the histograms of one node are extracted
+   in parts on many threads, so the logs read the same on every run.
+*/
+struct sanity_log_buffer
+{
+  // Line, and if it goes to the multi-value log.
+  std::vector<std::pair<string, bool>>	_M_lines;
+
+  void
+  write() const
+  {
+    std::lock_guard<std::mutex> lock(ofsmutex);
+    for (const auto& [ line, multip ] : _M_lines)
+      (multip ? ofsmultiv : ofssinglev) << line << std::endl;
+  }
+};
+
+
+/// Sanity check log lines made on this thread go to this buffer, if
+/// set, instead of straight to the logs.
+sanity_log_buffer*&
+sanity_log_buffering()
+{
+  static thread_local sanity_log_buffer* buffer = nullptr;
+  return buffer;
+}
+
+
+/// Buffer sanity check log lines in @buf while this is in scope.
+struct sanity_log_scope
+{
+  sanity_log_buffer*	_M_previous;
+
+  explicit
+  sanity_log_scope(sanity_log_buffer& buf)
+  : _M_previous(std::exchange(sanity_log_buffering(), &buf)) { }
+
+  sanity_log_scope(const sanity_log_scope&) = delete;
+  sanity_log_scope& operator=(const sanity_log_scope&) = delete;
+
+  ~sanity_log_scope()
+  { sanity_log_buffering() = _M_previous; }
+};
+
+
+void
+write_sanity_log(const string& line, const bool multip)
+{
+  if (sanity_log_buffer* buf = sanity_log_buffering())
+    buf->_M_lines.emplace_back(line, multip);
+  else
+    {
+      std::lock_guard<std::mutex> lock(ofsmutex);
+      (multip ? ofsmultiv : ofssinglev) << line << std::endl;
+    }
 }
 
 
@@ -262,86 +569,112 @@ extract_histogram_field_mean(const rj::Value& v, const string& probe)
    histogram buckets. This case will have one value and three entries.
 */
 string
-extract_histogram_field_median(const rj::Value& v, const string& probe)
+extract_histogram_node_median(const rj::Value& vh, const string& probe)
 {
   string found;
-  auto i = v.FindMember(probe.c_str());
-  if (i != v.MemberEnd())
+  uint nvalues(0);
+  const buckets_t buckets = extract_histogram_buckets(vh, nvalues);
+  if (!buckets.empty())
     {
-      // Get histogram type.
-      const rj::Value& vht = i->value["histogram_type"];
-      histogram_t htype = static_cast<histogram_t>(field_value_to_int(vht));
-      bool htypecp = htype == histogram_t::categorical;
-      bool htypekp = htype == histogram_t::keyed;
-
-      // Get (value, count) for each bucket, in the form of (string, int).
-      const rj::Value& vvs = i->value["values"];
-      if (vvs.IsObject())
+      const int64_t vvsize = histogram_count(buckets);
+
+      std::ostringstream oss;
+      oss << std::left << std::setfill(' ') << std::setw(48) << probe
+	  << k::tab << "sample size: " << std::setw(6) << vvsize
+	  << k::tab << "values: " << std::setw(6) << nvalues;
+
+      // Check for single-sample case, and if true return sum
+      // instead.  Sanity check that there exist zero-fill
+      // buckets to each side, will assume 3 values (zero
+      // left, value, zero right) is exactly this case...
+      if (vvsize == 1 && nvalues == 3)
 	{
-	  // Iterate through object.
-	  int nvalues(0);
-	  std::vector<int> vvalues;
-	  for (vcmem_iterator j = vvs.MemberBegin(); j != vvs.MemberEnd(); ++j)
-	    {
-	      const rj::Value& vbktcount = j->value;
-	      int bktcount = field_value_to_int(vbktcount);
+	  const rj::Value& sum = vh["sum"];
+	  found = field_value_to_string(sum);
+	  write_sanity_log(oss.str(), false);
+	}
+      else
+	{
+	  // Median differs by even/odd number of elements...
+	  double median = histogram_median(buckets);
+	  found = to_string(static_cast<uint>(median));
+	  write_sanity_log(oss.str(), true);
+	}
+    }
+  return found;
+}
 
-	      if (bktcount != 0 && !htypecp && !htypekp)
-		{
-		  // For "most" histograms, the name of the bucket
-		  // corresponds to a particular value. So, convert the
-		  // buck name above to an int value.
-		  string bktname = j->name.GetString();
-		  int bktv(std::stoi(bktname));
-
-		  // Add bktcount number of bktv values to histogram vector.
-		  vvalues.insert(vvalues.end(), bktcount, bktv);
-		}
 
-	      ++nvalues;
-	    }
+// Mean is the sum of the histogram samples divided by the number of
+// samples, from the buckets. No samples, no value.
+string
+extract_histogram_node_mean(const rj::Value& vh, const string&)
+{
+  string found;
+  uint nvalues(0);
+  const buckets_t buckets = extract_histogram_buckets(vh, nvalues);
+  if (!buckets.empty())
+    found = to_string(histogram_mean(buckets));
+  return found;
+}
 
-	  if (!vvalues.empty())
-	    {
-	      const uint vvsize = vvalues.size();
-
-	      std::ostringstream oss;
-	      oss << std::left << std::setfill(' ') << std::setw(48) << probe
-		  << k::tab << "sample size: " << std::setw(6) << vvsize
-		  << k::tab << "values: " << std::setw(6) << nvalues;
-
-	      // Check for single-sample case, and if true return sum
-	      // instead.  Sanity check that there exist zero-fill
-	      // buckets to each side, will assume 3 values (zero
-	      // left, value, zero right) is exactly this case...
-	      if (vvsize == 1 && nvalues == 3)
-		{
-		  const rj::Value& sum = i->value["sum"];
-		  found = field_value_to_string(sum);
-		  ofssinglev << oss.str() << std::endl;
-		}
-	      else
-		{
-		  std::nth_element(vvalues.begin(),
-				   vvalues.begin() + vvsize / 2,
-				   vvalues.end());
-
-		  // Median differs by even/odd number of elements...
-		  double median(0);
-		  if (vvsize % 2 != 0)
-		    median = vvalues[vvsize / 2];
-		  else
-		    {
-		      auto m1 = vvalues[vvsize / 2];
-		      auto m2 = vvalues[(vvsize / 2) - 1];
-		      median = (m1 + m2) / 2;
-		    }
-		  found = to_string(static_cast<uint>(median));
-		  ofsmultiv << oss.str() << std::endl;
-		}
-	    }
-	}
-    }
+
+/// Quantile for histogram_view_t::quantile, in [0, 1]. Set once at
+/// start, before any extraction, as by --quantile.
+double&
+histogram_view_quantile()
+{
+  static double p = k::quantile_p;
+  return p;
+}
+
+
+/// Quantile @p of histogram node, p95 unless otherwise specified.
+string
+extract_histogram_node_quantile(const rj::Value& vh, const string&,
+				const double p = k::quantile_p)
+{
+  string found;
+  uint nvalues(0);
+  const buckets_t buckets = extract_histogram_buckets(vh, nvalues);
+  if (!buckets.empty())
+    found = to_string(static_cast<uint>(histogram_quantile(buckets, p)));
+  return found;
+}
+
+
+string
+extract_histogram_node_range(const rj::Value& vh, const string&)
+{
+  string found;
+  uint nvalues(0);
+  const buckets_t buckets = extract_histogram_buckets(vh, nvalues);
+  if (!buckets.empty())
+    found = to_string(histogram_range(buckets));
+  return found;
+}
+
+
+string
+extract_histogram_node_stddev(const rj::Value& vh, const string&)
+{
+  string found;
+  uint nvalues(0);
+  const buckets_t buckets = extract_histogram_buckets(vh, nvalues);
+  if (!buckets.empty())
+    found = to_string(histogram_stddev(buckets));
+  return found;
+}
+
+
+string
+extract_histogram_node_mdev(const rj::Value& vh, const string&)
+{
+  string found;
+  uint nvalues(0);
+  const buckets_t buckets = extract_histogram_buckets(vh, nvalues);
+  if (!buckets.empty())
+    found = to_string(histogram_mdev(buckets));
   return found;
 }
 
@@ -380,52 +713,137 @@ extract_pseudo_histogram_field(const rj::Value& v, const histogram_view_t hview)
 }
 
 
+// Not extracted, for the static_assert in extract_histogram_node.
+template<histogram_view_t _View>
+  constexpr bool unsupported_view_v = false;
+
+
+/// Extract from histogram node @vh, the value of the histogram named
+/// @probe, as view _View. Picked at compile time, so the loops over
+/// probes that call this have no test of the view.
+template<histogram_view_t _View>
+string
+extract_histogram_node(const rj::Value& vh, const string& probe)
+{
+  if constexpr (_View == histogram_view_t::median)
+    return extract_histogram_node_median(vh, probe);
+  else if constexpr (_View == histogram_view_t::mean)
+    return extract_histogram_node_mean(vh, probe);
+  else if constexpr (_View == histogram_view_t::sum)
+    return extract_histogram_node_sum(vh, probe);
+  else if constexpr (_View == histogram_view_t::quantile)
+    return extract_histogram_node_quantile(vh, probe,
+					   histogram_view_quantile());
+  else if constexpr (_View == histogram_view_t::range)
+    return extract_histogram_node_range(vh, probe);
+  else if constexpr (_View == histogram_view_t::stddev)
+    return extract_histogram_node_stddev(vh, probe);
+  else if constexpr (_View == histogram_view_t::mdev)
+    return extract_histogram_node_mdev(vh, probe);
+  else
+    static_assert(unsupported_view_v<_View>, "view not extracted");
+}
+
+
+/// Extract from parent node @v, the value of the histogram named @probe.
+template<histogram_view_t _View>
 string
-extract_histogram_field(const rj::Value& v, const string& probe,
-			const histogram_view_t hview)
+extract_histogram_field(const rj::Value& v, const string& probe)
 {
   string nvalue;
-  switch (hview)
+  auto i = v.FindMember(probe.c_str());
+  if (i != v.MemberEnd())
+    nvalue = extract_histogram_node<_View>(i->value, probe);
+  return nvalue;
+}
+
+
+using id_value_rows = std::vector<std::pair<uint, string>>;
+
+// Serialize rows in id order, which is sorted probe name order.
+void
+serialize_probe_rows(id_value_rows& rows, const probe_index& probes,
+		     ostream& ofs)
+{
+  std::sort(rows.begin(), rows.end());
+  for (const auto& [ id, nvalue ] : rows)
+    ofs << probes[id] << "," << nvalue << std::endl;
+}
+
+
+using id_node_refs = std::vector<std::pair<uint, const rj::Value*>>;
+
+// Members of node @v named in @probes, except those already found in
+// @skip, if given, in member order. Finds nodes without extracting.
+id_node_refs
+probe_node_refs(const rj::Value& v, const probe_index& probes,
+		const probe_matches* skip = nullptr)
+{
+  id_node_refs refs;
+  if (v.IsObject())
     {
-      case histogram_view_t::median:
-	nvalue = extract_histogram_field_median(v, probe);
-	break;
-      case histogram_view_t::mean:
-	nvalue = extract_histogram_field_mean(v, probe);
-	break;
-      case histogram_view_t::sum:
-	nvalue = extract_histogram_field_sum(v, probe);
-	break;
-      case histogram_view_t::quantile:
-	throw std::runtime_error(k::errorprefix + "histogram extract quantile");
-      default:
-	break;
+      for (vcmem_iterator i = v.MemberBegin(); i != v.MemberEnd(); ++i)
+	{
+	  const uint id = probes.find(to_string_view(i->name));
+	  if (id != probe_index::npos && !(skip && skip->test(id)))
+	    refs.emplace_back(id, &i->value);
+	}
     }
-  return nvalue;
+  return refs;
 }
 
 
-// Assume v is the base histogram node, probes is the list of
-// histogram names to extract.
-strings
-extract_histogram_fields(const rj::Value& v, const strings& probes,
-			 ostream& ofs,
-			 const histogram_view_t hview)
+// Rows of the histograms in node @v named in @probes, except those
+// already found in @skip, if given. Walk the members of v once,
+// looking up each name in the probe index.
+template<histogram_view_t _View>
+id_value_rows
+histogram_field_rows(const rj::Value& v, const probe_index& probes,
+		     const probe_matches* skip = nullptr)
 {
-  strings found;
+  id_value_rows rows;
   if (v.IsObject())
     {
-      for (const string& probe : probes)
+      for (vcmem_iterator i = v.MemberBegin(); i != v.MemberEnd(); ++i)
 	{
-	  string hvalue = extract_histogram_field(v, probe, hview);
-	  if (!hvalue.empty())
+	  const uint id = probes.find(to_string_view(i->name));
+	  if (id != probe_index::npos && !(skip && skip->test(id)))
 	    {
-	      ofs << probe << "," << hvalue << std::endl;
-	      found.push_back(probe);
+	      const string& probe = probes[id];
+	      string hvalue = extract_histogram_node<_View>(i->value, probe);
+	      if (!hvalue.empty())
+		rows.emplace_back(id, hvalue);
 	    }
 	}
     }
-  return found;
+  return rows;
+}
+
+
+// Keep the @rows not yet in @matches, mark them found, and serialize.
+uint
+serialize_new_probe_rows(id_value_rows& rows, probe_matches& matches,
+			 ostream& ofs)
+{
+  auto foundp = [&matches](const auto& row) { return matches.test(row.first); };
+  rows.erase(std::remove_if(rows.begin(), rows.end(), foundp), rows.end());
+  for (const auto& row : rows)
+    matches.set(row.first);
+  serialize_probe_rows(rows, matches._M_index, ofs);
+  return rows.size();
+}
+
+
+// Assume v is the base histogram node, matches is the accounting of
+// histogram names to extract.
+template<histogram_view_t _View>
+uint
+extract_histogram_fields(const rj::Value& v, probe_matches& matches,
+			 ostream& ofs)
+{
+  id_value_rows rows = histogram_field_rows<_View>(v, matches._M_index,
+						   &matches);
+  return serialize_new_probe_rows(rows, matches, ofs);
 }
 
 
@@ -468,24 +886,38 @@ extract_scalar_field(const rj::Value& v, const string& probe)
 }
 
 
-strings
-extract_scalar_fields(const rj::Value& v, const strings& probes,
-		      ostream& ofs)
+// Rows of the scalars in node @v named in @probes, except those
+// already found in @skip, if given.
+id_value_rows
+scalar_field_rows(const rj::Value& v, const probe_index& probes,
+		  const probe_matches* skip = nullptr)
 {
-  strings found;
+  id_value_rows rows;
   if (v.IsObject())
     {
-      for (const string& probe : probes)
+      for (vcmem_iterator i = v.MemberBegin(); i != v.MemberEnd(); ++i)
 	{
-	  string nvalue = extract_scalar_field(v, probe);
-	  if (!nvalue.empty())
+	  const uint id = probes.find(to_string_view(i->name));
+	  if (id != probe_index::npos && !(skip && skip->test(id)))
 	    {
-	      ofs << probe << "," << nvalue << std::endl;
-	      found.push_back(probe);
+	      string nvalue = field_value_to_string(i->value);
+	      if (!nvalue.empty())
+		rows.emplace_back(id, nvalue);
 	    }
 	}
     }
-  return found;
+  return rows;
+}
+
+
+// Assume v is the base scalar node, matches is the accounting of
+// scalar names to extract.
+uint
+extract_scalar_fields(const rj::Value& v, probe_matches& matches,
+		      ostream& ofs)
+{
+  id_value_rows rows = scalar_field_rows(v, matches._M_index, &matches);
+  return serialize_new_probe_rows(rows, matches, ofs);
 }
 
 
@@ -623,7 +1055,7 @@ environment
 extract_environment_har(const string& harfile)
 {
   // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(harfile));
+  json_dom dom(deserialize_json_to_dom(harfile));
 
   environment env = { };
   const string klog("log");
@@ -715,7 +1147,7 @@ environment
 deserialize_json_to_environment(const string ifile)
 {
   // Load input JSON data file into DOM.
-  rj::Document dom(deserialize_json_to_dom(ifile));
+  json_dom dom(deserialize_json_to_dom(ifile));
 
   environment env { };
   if (dom.IsObject() && dom.HasMember("sw_name"))
@@ -785,6 +1217,16 @@ deserialize_environment(const string cifile)
       auto vpos = jfile.rfind(verbose);
       if (vpos != string::npos)
 	jfile.erase(vpos, verbose.size() - 1); // leave the period.
+
+      // Remove field count in *.4.environment.json, from *.4.csv.
+      const string envext(k::environment_ext);
+      const size_t nenv = envext.size();
+      if (!filesystem::exists(jfile) && jfile.size() > nenv + 2)
+	{
+	  const size_t dpos = jfile.size() - nenv - 2;
+	  if (jfile[dpos] == '.' && std::isdigit(jfile[dpos + 1]))
+	    jfile.erase(dpos, 2);
+	}
     }
   else
     {
@@ -897,7 +1339,7 @@ list_dom_array_fields(const rj::Document& dom,
 void
 list_json_fields(std::string ifile,  uint recursen)
 {
-  rj::Document dom(deserialize_json_to_dom(ifile));
+  json_dom dom(deserialize_json_to_dom(ifile));
   if (dom.IsObject())
     list_dom_object_fields(dom, recursen);
   else
@@ -0,0 +1,289 @@
+// mozilla radial label layout -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_LABEL_H
+#define moz_X_LABEL_H 1
+
+#include <cmath>
+#include <limits>
+
+#include "moz-perf-x-svg.h"
+
+
+namespace moz {
+
+namespace constants {
+  // Advance of one character of a monospace face, in em.
+  constexpr double mono_advance = 0.6;
+
+  // Most times a label is pushed out along its ray to clear others.
+  constexpr uint label_nudges = 16;
+
+  // Turns of a label off its ray, in degrees, tried in order when it
+  // cannot be cleared on the ray inside the canvas.
+  constexpr double label_turns[] = { 0, 1.5, -1.5, 3, -3 };
+}
+
+
+/**
+   Box of one label laid along a ray: center, unit axis along the
+   text, and half extents along and across the text. The box is
+   rotated with the text, not axis-aligned.
+*/
+struct label_box
+{
+  double	_M_cx;
+  double	_M_cy;
+  double	_M_ux;
+  double	_M_uy;
+  double	_M_hw;
+  double	_M_hh;
+
+  /// Box of text @w long and @h high, along unit ray (@ux, @uy) from
+  /// the origin, starting @d from it.
+  static label_box
+  on_ray(const double ux, const double uy, const double d, const double w,
+	 const double h)
+  { return { (d + w / 2) * ux, (d + w / 2) * uy, ux, uy, w / 2, h / 2 }; }
+
+  /// Half extents of the axis-aligned box around this one.
+  double
+  half_width() const
+  { return _M_hw * std::abs(_M_ux) + _M_hh * std::abs(_M_uy); }
+
+  double
+  half_height() const
+  { return _M_hw * std::abs(_M_uy) + _M_hh * std::abs(_M_ux); }
+
+  /// Interval of this box projected on unit axis (@ax, @ay).
+  void
+  project(const double ax, const double ay, double& lo, double& hi) const
+  {
+    const double c = _M_cx * ax + _M_cy * ay;
+    const double r = _M_hw * std::abs(_M_ux * ax + _M_uy * ay)
+      + _M_hh * std::abs(_M_ux * ay - _M_uy * ax);
+    lo = c - r;
+    hi = c + r;
+  }
+
+  /// Overlap, by separating axes: the two axes of each box.
+  bool
+  overlapsp(const label_box& o) const
+  {
+    const double axes[4][2] = { { _M_ux, _M_uy }, { -_M_uy, _M_ux },
+				{ o._M_ux, o._M_uy }, { -o._M_uy, o._M_ux } };
+    for (const auto& a : axes)
+      {
+	double lo1, hi1, lo2, hi2;
+	project(a[0], a[1], lo1, hi1);
+	o.project(a[0], a[1], lo2, hi2);
+	if (hi1 <= lo2 || hi2 <= lo1)
+	  return false;
+      }
+    return true;
+  }
+};
+
+
+/// Canvas around the labels, relative to the origin of their rays.
+struct label_bounds
+{
+  double	_M_x0;
+  double	_M_y0;
+  double	_M_x1;
+  double	_M_y1;
+
+  /// All of box @b is inside.
+  bool
+  containsp(const label_box& b) const
+  {
+    return b._M_cx - b.half_width() >= _M_x0
+      && b._M_cx + b.half_width() <= _M_x1
+      && b._M_cy - b.half_height() >= _M_y0
+      && b._M_cy + b.half_height() <= _M_y1;
+  }
+};
+
+
+/**
+   Uniform grid over placed label boxes, for finding the boxes that
+   may overlap a new one without testing all of them. Each box is in
+   every cell its axis-aligned bounds touch. With cells about the size
+   of a label, a lookup tests a few boxes, whatever the number placed.
+*/
+struct label_grid
+{
+  const double					_M_cell;
+  std::unordered_map<int64_t, std::vector<uint>>	_M_cells;
+  std::vector<label_box>			_M_boxes;
+  std::vector<uint>				_M_seen;
+  uint						_M_stamp;
+
+  explicit
+  label_grid(const double cell) : _M_cell(cell), _M_stamp(0) { }
+
+  void
+  insert(const label_box& b)
+  {
+    const uint id = _M_boxes.size();
+    _M_boxes.push_back(b);
+    _M_seen.push_back(0);
+    for_each_cell(b, [this, id](const int64_t key)
+		  { _M_cells[key].push_back(id); });
+  }
+
+  /// Call @fn on each placed box overlapping @b, once each.
+  template<typename _Fn>
+  void
+  for_each_overlap(const label_box& b, _Fn fn)
+  {
+    ++_M_stamp;
+    for_each_cell(b, [&](const int64_t key)
+    {
+      auto i = _M_cells.find(key);
+      if (i == _M_cells.end())
+	return;
+      for (const uint id : i->second)
+	if (_M_seen[id] != _M_stamp)
+	  {
+	    _M_seen[id] = _M_stamp;
+	    if (b.overlapsp(_M_boxes[id]))
+	      fn(_M_boxes[id]);
+	  }
+    });
+  }
+
+private:
+  template<typename _Fn>
+  void
+  for_each_cell(const label_box& b, _Fn fn) const
+  {
+    const int64_t x0 = std::floor((b._M_cx - b.half_width()) / _M_cell);
+    const int64_t x1 = std::floor((b._M_cx + b.half_width()) / _M_cell);
+    const int64_t y0 = std::floor((b._M_cy - b.half_height()) / _M_cell);
+    const int64_t y1 = std::floor((b._M_cy + b.half_height()) / _M_cell);
+    for (int64_t x = x0; x <= x1; ++x)
+      for (int64_t y = y0; y <= y1; ++y)
+	fn(int64_t((uint64_t(x) << 32) ^ uint32_t(y)));
+  }
+};
+
+
+/// One placed label: angle of its value clockwise from north in
+/// degrees, turn of the text off that ray in degrees, and distance
+/// from the origin to the start of the text.
+struct radial_label
+{
+  string	_M_id;
+  value_type	_M_value;
+  double	_M_angle;
+  double	_M_turn;
+  double	_M_distance;
+  bool		_M_clearp;
+};
+
+
+/// Width of @text in typography @typo, as a monospace face.
+double
+label_text_width(const typography& typo, const string& text)
+{ return text.size() * typo._M_size * k::mono_advance; }
+
+
+/**
+   Lay out labels for ids and values @iv on the radial arc, without
+   overlaps where possible, inside canvas @bounds.
+
+   Each label is on the ray for its value: the arc @range of degrees
+   clockwise from north is scaled to @value_max. Labels start @rspace
+   out from @radius. Labels are placed greedily in order of angle.
+   If a label overlaps ones already placed, it is pushed out along
+   its ray to just past the farthest of them, up to label_nudges
+   times, while it stays inside the canvas. If that does not clear
+   it, the same is tried with the text turned a little off the ray,
+   by each of label_turns. After that it stays at the start of its
+   ray, and is not clear.
+
+   Only clear labels go in the grid. They do not overlap each other,
+   so a grid cell holds a few of them however dense the labels are,
+   and each label tries a fixed number of positions. So placement is
+   about linear, and sorting, O(n log n), is most of the layout.
+*/
+std::vector<radial_label>
+layout_radial_labels(const id_value_umap& iv, const value_type value_max,
+		     const point_2t range, const double radius,
+		     const double rspace, const typography& typo,
+		     const label_bounds& bounds)
+{
+  auto [ amin, amax ] = range;
+  std::vector<radial_label> labels;
+  labels.reserve(iv.size());
+  for (const auto& [ id, v ] : iv)
+    {
+      const double f = value_max > 0 ? std::clamp(v / value_max, 0.0, 1.0) : 0;
+      labels.push_back({ id, v, amin + f * (amax - amin), 0, radius + rspace,
+			 false });
+    }
+  auto lessf = [](const radial_label& a, const radial_label& b)
+  { return std::tie(a._M_angle, a._M_id) < std::tie(b._M_angle, b._M_id); };
+  std::sort(labels.begin(), labels.end(), lessf);
+
+  const double h = typo._M_size;
+  const double gap = h / 2;
+  const double start = radius + rspace;
+  label_grid grid(std::max(2 * h, 8.0));
+  for (radial_label& l : labels)
+    {
+      const double w = label_text_width(typo, l._M_id);
+      for (const double turn : k::label_turns)
+	{
+	  const double rad = (l._M_angle + turn) * M_PI / 180;
+	  const double ux = std::sin(rad);
+	  const double uy = -std::cos(rad);
+
+	  double d = start;
+	  for (uint n = 0; n <= k::label_nudges; ++n)
+	    {
+	      const label_box b = label_box::on_ray(ux, uy, d, w, h);
+	      if (!bounds.containsp(b))
+		break;
+
+	      double farthest = -std::numeric_limits<double>::infinity();
+	      grid.for_each_overlap(b, [&](const label_box& o)
+	      {
+		double lo, hi;
+		o.project(ux, uy, lo, hi);
+		farthest = std::max(farthest, hi);
+	      });
+	      if (farthest == -std::numeric_limits<double>::infinity())
+		{
+		  l._M_turn = turn;
+		  l._M_distance = d;
+		  l._M_clearp = true;
+		  grid.insert(b);
+		  break;
+		}
+	      d = std::max(d + gap, farthest + gap);
+	    }
+	  if (l._M_clearp)
+	    break;
+	}
+    }
+  return labels;
+}
+
+} // namespace moz
+#endif
@@ -0,0 +1,228 @@
+// mozilla browsertime log extraction -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_LOG_H
+#define moz_X_LOG_H 1
+
+#include <iostream>
+
+#include "moz-perf-x-json.h"
+
+
+namespace moz {
+
+/// One metric from a browsertime log summary line, times in ms.
+struct log_metric
+{
+  std::string_view	name;
+  double		value = 0;
+  std::string_view	unit;
+  double		variance = 0;
+};
+
+
+/// Summary line of one url from a browsertime log. Views are into the line.
+struct log_summary
+{
+  std::string_view		url;
+  uint				requests = 0;
+  uint				runs = 0;
+  std::vector<log_metric>	metrics;
+};
+
+
+/// Parse number and unit at the start of @s, as in 1.12s, 529ms, or 0.
+/// Values in seconds are converted to milliseconds.
+double
+parse_log_quantity(std::string_view s, std::string_view& unit)
+{
+  double d(0);
+  auto [ ptr, ec ] = std::from_chars(s.data(), s.data() + s.size(), d);
+  if (ec != std::errc())
+    d = 0;
+  unit = s.substr(ptr - s.data());
+  unit = unit.substr(0, unit.find_first_of(" )"));
+  if (unit == "s")
+    {
+      d *= 1000;
+      unit = "ms";
+    }
+  return d;
+}
+
+
+/// Parse summary line @line into @summary, false if not a summary line.
+bool
+parse_log_summary(std::string_view line, log_summary& summary)
+{
+  const std::string_view marker("INFO: [browsertime] ");
+  const std::string_view runsend(" runs)");
+  if (!line.empty() && line.back() == '\r')
+    line.remove_suffix(1);
+  auto mpos = line.find(marker);
+  if (mpos == std::string_view::npos || line.size() < runsend.size()
+      || line.substr(line.size() - runsend.size()) != runsend)
+    return false;
+
+  summary = log_summary();
+  line.remove_prefix(mpos + marker.size());
+  const auto urlend = line.find(k::space);
+  if (urlend == std::string_view::npos)
+    return false;
+  summary.url = line.substr(0, urlend);
+  line.remove_prefix(urlend + 1);
+
+  // Last is run count, as in (10 runs).
+  const auto runspos = line.rfind(" (");
+  if (runspos == std::string_view::npos)
+    return false;
+  const std::string_view runs = line.substr(runspos + 2);
+  std::from_chars(runs.data(), runs.data() + runs.size(), summary.runs);
+  line = line.substr(0, runspos);
+
+  // Comma separated: optional request count, then name: value (±variance).
+  while (!line.empty())
+    {
+      const auto segend = line.find(", ");
+      const std::string_view seg = line.substr(0, segend);
+      line.remove_prefix(segend == std::string_view::npos
+			 ? line.size() : segend + 2);
+
+      const auto colon = seg.find(": ");
+      if (colon == std::string_view::npos)
+	{
+	  if (seg.find(" requests") != std::string_view::npos)
+	    std::from_chars(seg.data(), seg.data() + seg.size(),
+			    summary.requests);
+	  continue;
+	}
+
+      log_metric m;
+      m.name = seg.substr(0, colon);
+      const std::string_view rest = seg.substr(colon + 2);
+      m.value = parse_log_quantity(rest, m.unit);
+
+      const std::string_view pm("(\u00b1");
+      const auto vpos = rest.find(pm);
+      if (vpos != std::string_view::npos)
+	{
+	  std::string_view vunit;
+	  m.variance = parse_log_quantity(rest.substr(vpos + pm.size()), vunit);
+	}
+      summary.metrics.push_back(m);
+    }
+  return !summary.metrics.empty();
+}
+
+
+/**
+   Parse the log bits that look like this:
+
+Fenix
+[2020-07-21 22:11:47] INFO: [browsertime] https://cnn.com/ampstories/us/why-hurricane-michael-is-a-monster-unlike-any-other TTFB: 419ms (±37.43ms), firstPaint: 1.12s (±70.13ms), firstVisualChange: 2.27s (±53.92ms), DOMContentLoaded: 529ms (±39.98ms), Load: 1.47s (±64.08ms), speedIndex: 2.29s (±52.76ms), perceptualSpeedIndex: 2.29s (±52.78ms), contentfulSpeedIndex: 2.27s (±53.91ms), visualComplete85: 2.29s (±52.93ms), lastVisualChange: 2.75s (±52.84ms) (10 runs)
+
+Chrome
+[2020-07-21 21:15:13] INFO: [browsertime] https://cnn.com/ampstories/us/why-hurricane-michael-is-a-monster-unlike-any-other 28 requests, TTFB: 357ms (±103.34ms), firstPaint: 1.84s (±95.03ms), firstVisualChange: 2.14s (±91.56ms), FCP: 2.16s (±92.83ms), DOMContentLoaded: 510ms (±104.30ms), LCP: 1.78s (±108.67ms), CLS: 0 (±0.00), Load: 1.42s (±211.46ms), speedIndex: 2.25s (±89.90ms), perceptualSpeedIndex: 2.24s (±89.95ms), contentfulSpeedIndex: 2.14s (±93.25ms), visualComplete85: 2.26s (±91.85ms), lastVisualChange: 2.26s (±91.85ms) (10 runs)
+
+Pass these logs to 3-field CSV of form (metric,time in ms, variance in ms) as:
+TTFB,357,103.34
+
+The log is read one line at a time, and every summary line is
+extracted, one per url tested. A log with one url makes one CSV file
+named for the log; with more, each is named for the log and the url
+domain, as in browsertime-sites-cnn.csv. Only the current summary is
+kept, so memory use does not grow with the size of the log.
+
+logfile = input browsertime log file
+edits = edit list of probe names to find in log file, if none extract all
+ */
+void
+extract_browsertime_log(const string logfile, const edit_list& edits)
+{
+  // Probe names from edit list.
+  const probe_index& probes = edits._M_probes;
+
+  std::ifstream ifs(logfile);
+  if (!ifs.good())
+    throw std::runtime_error(k::errorprefix + "extract_browsertime_log:: "
+			     + "cannot open " + logfile);
+
+  const string lstem = logfile.substr(0, logfile.size() - 4);
+  std::unordered_map<string, uint> domains;
+  uint nsummaries(0);
+
+  // First summary waits, in case it is the only one.
+  string firstcsv;
+  string firstdomain;
+  auto writef = [&](const string& ostem, const string& csv)
+  {
+    std::ofstream ofs(make_data_file(ostem, k::csv_ext));
+    ofs << csv;
+  };
+
+  string line;
+  log_summary summary;
+  while (std::getline(ifs, line))
+    {
+      if (!parse_log_summary(line, summary))
+	continue;
+
+      ostringstream oss;
+      for (const log_metric& m : summary.metrics)
+	if (probes.empty() || probes.find(m.name) != probe_index::npos)
+	  oss << m.name << k::comma << m.value << k::comma << m.variance
+	      << k::newline;
+      string csv(oss.str());
+
+      string domain;
+      try
+	{
+	  domain = url_to_domain(string(summary.url));
+	}
+      catch (const std::exception&)
+	{
+	  domain = "url";
+	}
+      if (uint n = ++domains[domain]; n > 1)
+	domain += k::hypen + to_string(n);
+
+      std::clog << summary.url << ": " << summary.requests << " requests, "
+		<< summary.metrics.size() << " metrics, " << summary.runs
+		<< " runs" << std::endl;
+
+      if (++nsummaries == 1)
+	{
+	  firstcsv = std::move(csv);
+	  firstdomain = domain;
+	  continue;
+	}
+      if (nsummaries == 2)
+	writef(lstem + k::hypen + firstdomain, firstcsv);
+      writef(lstem + k::hypen + domain, csv);
+    }
+
+  if (nsummaries == 0)
+    {
+      string m("extract_browsertime_log::error cannot find results block");
+      throw std::runtime_error(m + " in " + logfile);
+    }
+  if (nsummaries == 1)
+    writef(lstem, firstcsv);
+}
+
+} // namespace moz
+#endif
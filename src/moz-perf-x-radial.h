@@ -20,89 +20,156 @@
 
 #include "moz-perf-x-svg.h"
 #include "moz-perf-x-json.h"
+#include "moz-perf-x-csv.h"
+#include "moz-perf-x-store.h"
+#include "moz-perf-x-raster.h"
+#include "moz-perf-x-label.h"
 #include "a60-svg-radial-arc.h"
 
 
 namespace moz {
 
 
-// CSV form with metric, value.
-// Read CSV file of [marker name || probe name] and value, and
-// store in hash_map, return this plus the max value as a tuple.
-// ifile == input csv file
+// CSV form with metric, value, and optional deviations.
+// Convert CSV rows of [marker name || probe name] and value to
+// a hash_map, and update the max value.
 // value_max == maximum value of all inputs
 // scale == default 1, otherwise conversion factor so that value/scale
 id_value_umap
-deserialize_id_value_map(istream& istr, value_type& value_max,
+csv_rows_to_id_value_map(const csv_rows& rows, value_type& value_max,
 			 value_type scale = 1)
 {
   id_value_umap probe_map;
-  do
+  probe_map.reserve(rows.size());
+  for (const csv_row& row : rows)
     {
-      string pname;
-      getline(istr, pname, ',');
-      if (istr.good())
+      value_type pvalue(row.value);
+      if (pvalue != 0 && scale != 1)
 	{
-	  value_type pvalue(0);
-	  istr >> pvalue;
-
-	  if (pvalue != 0 && scale != 1)
-	    {
-	      // Then scale by given...
-	      pvalue /= scale;
-	    }
-
-	  // Extract remaining newline.
-	  istr.ignore(79, k::newline);
-
-	  probe_map.insert(make_pair(pname, pvalue));
-	  value_max = std::max(pvalue, value_max);
+	  // Then scale by given...
+	  pvalue /= scale;
 	}
+
+      probe_map.emplace(string(row.name), pvalue);
+      value_max = std::max(pvalue, value_max);
     }
-  while (istr.good());
   return probe_map;
 }
 
 
+id_value_umap
+deserialize_id_value_map(istream& istr, value_type& value_max,
+			 value_type scale = 1)
+{
+  const string data(std::istreambuf_iterator<char>(istr), {});
+  return csv_rows_to_id_value_map(parse_csv(data), value_max, scale);
+}
+
+
+// Read CSV file @ifile, return the hash_map of rows.
 id_value_umap
 deserialize_csv_to_id_value_map(const string& ifile, value_type& value_max,
 				value_type scale = 1)
 {
-  std::ifstream ifs(ifile);
-  if (!ifs.good())
-    {
-      ostringstream mss;
-      mss << k::errorprefix << "deserialize_csv_to_id_value_map:: "
-	  << "cannot open input file: "
-	  << ifile << std::endl;
-      throw std::runtime_error(mss.str());
-    }
-  else
-    return deserialize_id_value_map(ifs, value_max, scale);
+  const csv_file csv(ifile);
+  return csv_rows_to_id_value_map(csv.rows(), value_max, scale);
 }
 
 
+/**
+   Input CSV file, or run from a metric store, loaded for rendering,
+   with the summary values used for scaling. Load each file once, and
+   then pass this to both the scaling logic and render_radial instead
+   of the file name.
+*/
+struct radial_dataset
+{
+  string	_M_file;
+  id_value_umap	_M_ids;
+  value_type	_M_max = 0;
+  value_type	_M_min = 0;
+  size_t	_M_count = 0;
+
+  radial_dataset() = default;
+
+  explicit
+  radial_dataset(const string& ifile, value_type scale = 1)
+  : _M_file(ifile)
+  {
+    const csv_file csv(ifile);
+    init(csv.rows(), scale);
+  }
+
+  /// From run @run in a metric store.
+  radial_dataset(const metric_store& store, const uint run,
+		 value_type scale = 1)
+  : _M_file(store.run_name(run))
+  { init(store.rows(run), scale); }
+
+  bool
+  empty() const
+  { return _M_count == 0; }
+
+private:
+  void
+  init(const csv_rows& rows, value_type scale)
+  {
+    _M_ids = csv_rows_to_id_value_map(rows, _M_max, scale);
+    _M_count = _M_ids.size();
+    if (_M_count > 0)
+      {
+	auto lessv = [](const auto& a, const auto& b)
+	{ return a.second < b.second; };
+	_M_min = std::min_element(_M_ids.begin(), _M_ids.end(), lessv)->second;
+      }
+  }
+};
+
+
+/// Scale for values of metric type @imetrictype, to milliseconds.
+/// Glean is in nanoseconds, assumes glean-generated files include "glean".
+value_type
+metric_type_scale(const string& imetrictype)
+{
+  value_type ts = 1;
+  if (imetrictype.find("glean") != string::npos)
+    ts = 1000000;
+  return ts;
+}
+
+
+value_type
+largest_value_in(const radial_dataset& d1, const radial_dataset& d2)
+{ return std::max(d1._M_max, d2._M_max); }
+
+
 value_type
 largest_value_in(const string f1, const string f2 = "")
 {
   // Find max value in input files...
-  value_type maxv1(0);
+  radial_dataset d1;
   if (!f1.empty())
-    id_value_umap iv1 = deserialize_csv_to_id_value_map(f1, maxv1);
+    d1 = radial_dataset(f1);
 
-  value_type maxv2(0);
+  radial_dataset d2;
   if (!f2.empty())
-    id_value_umap iv2 = deserialize_csv_to_id_value_map(f2, maxv2);
-  return std::max(maxv1, maxv2);
+    d2 = radial_dataset(f2);
+  return largest_value_in(d1, d2);
 }
 
 
+/// Shared render state for render_radial, set once before rendering.
+/// Only read while rendering, so renders can run in parallel.
 void
 init_id_render_state_cache(const double opacity, const string hilite)
 {
   using svg::k::select;
   const select dviz = select::glyph | select::vector;
 
+  // Arc range for all radials.
+  point_2t& rrange = get_radial_range();
+  rrange = { 0, 270 };
+
   // Default.
   style dstyl = { color::black, opacity, color::white, opacity, 3 };
   add_to_id_render_state_cache("", dstyl, dviz);
@@ -132,10 +199,76 @@ init_id_render_state_cache(const double opacity, const string hilite)
 }
 
 
+/**
+   Render ids and values @iv on the arc centered at @origin, as a glyph
+   at @radius on the ray for each value, and a label pushed out along
+   that ray, inside the canvas of @obj, to clear the labels already
+   placed. See layout_radial_labels. Labels on the left read outwards,
+   not upside down. Returns the number of labels that still overlap
+   others.
+*/
+uint
+render_radial_labels(svg_element& obj, const point_2t origin,
+		     const typography& typo, const id_value_umap& iv,
+		     const value_type value_max, const int radius,
+		     const int rspace)
+{
+  // Canvas, relative to the origin.
+  auto [ ox, oy ] = origin;
+  const double width = obj._M_area._M_width;
+  const double height = obj._M_area._M_height;
+  const label_bounds bounds = { -double(ox), -double(oy), width - ox,
+				height - oy };
+  const std::vector<radial_label> labels =
+    layout_radial_labels(iv, value_max, get_radial_range(), radius, rspace,
+			 typo, bounds);
+
+  typography typoflip = typo;
+  typoflip._M_anchor = typography::anchor::end;
+  typoflip._M_align = typography::align::right;
+
+  uint nblocked(0);
+  for (const radial_label& l : labels)
+    {
+      const double grad = l._M_angle * M_PI / 180;
+      const id_render_state rst = get_id_render_state(l._M_id);
+      const point_2t gp(ox + std::lround(radius * std::sin(grad)),
+			oy - std::lround(radius * std::cos(grad)));
+      point_to_circle(obj, gp, rst.styl, 3);
+
+      // Text on its ray, turned off the value's ray if need be.
+      const double angle = l._M_angle + l._M_turn;
+      const double rad = angle * M_PI / 180;
+      const double ux = std::sin(rad);
+      const double uy = -std::cos(rad);
+
+      // Baseline moved down from the ray, in reading direction, so the
+      // text is centered on the ray as its box is.
+      const bool flipp = ux < 0;
+      const double rx = flipp ? -ux : ux;
+      const double ry = flipp ? -uy : uy;
+      const double down = typo._M_size * 0.35;
+      const int tx = ox + std::lround(l._M_distance * ux - ry * down);
+      const int ty = oy + std::lround(l._M_distance * uy + rx * down);
+
+      // Degrees counter-clockwise from east, as place_text_id rotates.
+      const double deg = std::fmod(450 - angle, 360);
+      if (flipp)
+	place_text_id(obj, typoflip, l._M_id, tx, ty, std::fmod(deg + 180, 360));
+      else
+	place_text_id(obj, typo, l._M_id, tx, ty, deg);
+      nblocked += !l._M_clearp;
+    }
+  return nblocked;
+}
+
+
 /**
    Render metrics in an arc centered at origin, starting at 0 degrees
    north and continuing around clockwise, according to metrics and
-   values in csv file.
+   values in the loaded csv file @data.
+
+   typo		== typography for metric labels, from make_typography_id
 
    hilite	== metric to highlight
 
@@ -145,35 +278,29 @@ init_id_render_state_cache(const double opacity, const string hilite)
    radius       == radius of arc
    rspace       == space between arc end and label text begin
 
+   collisionp	== lay out labels so they do not overlap, with
+		   render_radial_labels, instead of with kusama glyphs.
+		   Off unless a driver asks for it.
+
    contextp	== add in metadata about context if true, otherwise just do arc.
 
    Returns the time of the highlight metric or vmax.
  */
 value_type
-render_radial(svg_element& obj, const point_2t origin, const string idatacsv,
+render_radial(svg_element& obj, const point_2t origin,
+	      const radial_dataset& data, const typography& typo,
 	      const string imetrictype, const string hilite,
 	      const value_type vmax = 0,
-	      const int radius = 80, const int rspace = 24)
+	      const int radius = 80, const int rspace = 24,
+	      const bool collisionp = false)
 {
-  // Get id map and outcomes.
-  // Iif in nanoseconds scale to milliseconds
   // Iif vmax non-zero, scale rendered radials to vmax.
-  value_type ts = 1;
-
-  // Glean is in nanoseconds, assumes glean-generated files include "glean".
-  if (imetrictype.find("glean") != string::npos)
-    ts = 1000000;
-
-
-  value_type value_max(0);
-  id_value_umap iv = deserialize_csv_to_id_value_map(idatacsv, value_max, ts);
+  const id_value_umap& iv = data._M_ids;
+  value_type value_max = data._M_max;
   if (vmax != 0)
     value_max = vmax;
 
   // Render radial elements.
-  typography typo = make_typography_id();
-  point_2t& rrange = get_radial_range();
-  rrange = { 0, 270 };
 
 #if 0
   radiate_ids_per_uvalue_on_arc(obj, origin, typo, iv, value_max,
@@ -187,18 +314,162 @@ render_radial(svg_element& obj, const point_2t origin, const string idatacsv,
   stylinset._M_fill_opacity = 0;
   stylinset._M_stroke_opacity = 1;
   stylinset._M_stroke_size = 3;
-  direction_arc_at(obj, origin, radius, stylinset);
-  direction_arc_title_at(obj, origin, radius, rst.styl, k::webvitals);
-
-  // bool values: weigh-by-value, collision-avoidance
-  kusama_ids_per_uvalue_on_arc(obj, origin, typo, iv, value_max,
-			       radius, rspace, false, false);
+  // Same for every chart with this origin, radius, and style: cached.
+  auto [ ox, oy ] = origin;
+  std::ostringstream key;
+  key << "direction_arc-" << ox << k::comma << oy << k::hypen << radius
+      << k::hypen << style_layer_key(rst.styl) << k::hypen << k::webvitals;
+  add_svg_layer(obj, key.str(), [&](svg_element& layer)
+  {
+    direction_arc_at(layer, origin, radius, stylinset);
+    direction_arc_title_at(layer, origin, radius, rst.styl, k::webvitals);
+  });
+
+  if (collisionp)
+    {
+      const uint nblocked = render_radial_labels(obj, origin, typo, iv,
+						 value_max, radius, rspace);
+      if (nblocked > 0)
+	std::clog << data._M_file << ": " << nblocked
+		  << " labels overlap" << std::endl;
+    }
+  else
+    {
+      // bool values: weigh-by-value, collision-avoidance
+      kusama_ids_per_uvalue_on_arc(obj, origin, typo, iv, value_max,
+				   radius, rspace, false, false);
+      drain_svg(obj);
+    }
 #endif
 
-  value_type timev = iv.count(hilite) ? iv[hilite] : value_max;
+  auto ihilite = iv.find(hilite);
+  value_type timev = ihilite != iv.end() ? ihilite->second : value_max;
   return timev;
 }
 
+
+/// Render metrics from loaded csv file @data, as above.
+value_type
+render_radial(svg_element& obj, const point_2t origin,
+	      const radial_dataset& data,
+	      const string imetrictype, const string hilite,
+	      const value_type vmax = 0,
+	      const int radius = 80, const int rspace = 24,
+	      const bool collisionp = false)
+{
+  const typography typo = make_typography_id();
+  return render_radial(obj, origin, data, typo, imetrictype, hilite, vmax,
+		       radius, rspace, collisionp);
+}
+
+
+/// Render metrics from csv file @idatacsv, as above.
+value_type
+render_radial(svg_element& obj, const point_2t origin, const string idatacsv,
+	      const string imetrictype, const string hilite,
+	      const value_type vmax = 0,
+	      const int radius = 80, const int rspace = 24,
+	      const bool collisionp = false)
+{
+  // Get id map and outcomes.
+  // Iif in nanoseconds scale to milliseconds
+  const radial_dataset data(idatacsv, metric_type_scale(imetrictype));
+  return render_radial(obj, origin, data, imetrictype, hilite, vmax,
+		       radius, rspace, collisionp);
+}
+
+
+/// Typography made once, shared by all renders.
+struct uno_typography
+{
+  typography	_M_id;
+  typography	_M_hilite;
+  value_type	_M_hilite_size;
+};
+
+
+uno_typography
+make_uno_typography(const value_type tsz = 18)
+{
+  return { make_typography_id(), make_typography_metadata(tsz, true, color::red),
+	   tsz };
+}
+
+
+/// Render @data with environment @env into @obj, with labels laid out
+/// without overlaps if @collisionp.
+void
+render_radial_uno_chart(svg_element& obj, const radial_dataset& data,
+			const environment& env, const string& imetrictype,
+			const string& hilite, const uno_typography& typos,
+			const bool collisionp = false)
+{
+  const point_2t origin = obj.center_point();
+  value_type timev = render_radial(obj, origin, data, typos._M_id,
+				   imetrictype, hilite, 0, 80, 24, collisionp);
+
+  // Add metadata.
+  render_metadata(obj, env);
+
+  // Render metadata titles, times, or context.
+  auto x = obj._M_area._M_width / 2;
+  auto y = obj._M_area._M_height - moz::k::margin;
+  render_metadata_time(obj, timev, color::red, x, y);
+
+  const value_type tsz = typos._M_hilite_size;
+  place_text_at_point(obj, typos._M_hilite, hilite, x, y + (2 * tsz));
+}
+
+
+/**
+   Render @data with environment @env to svg file @fstem.
+
+   Written when done, and to png file @fstem if @ro asks for it, or
+   streamed as it is made if @so asks for it. A streamed svg is not
+   kept in memory, so cannot be rasterized. Labels are laid out
+   without overlaps if @collisionp.
+*/
+void
+render_radial_uno(const string& fstem, const radial_dataset& data,
+		  const environment& env, const string& imetrictype,
+		  const string& hilite, const uno_typography& typos,
+		  const raster_options& ro = raster_options(),
+		  const svg_stream_options& so = svg_stream_options(),
+		  const bool collisionp = false)
+{
+  if (so._M_streamp)
+    {
+      svg_stream stream(fstem, { 1920, 1080 }, so._M_gzipp, so._M_capacity);
+      add_canvas_layer(stream._M_obj);
+      render_radial_uno_chart(stream._M_obj, data, env, imetrictype, hilite,
+			      typos, collisionp);
+      stream.finish();
+    }
+  else
+    {
+      svg_element obj = initialize_svg(fstem);
+      render_radial_uno_chart(obj, data, env, imetrictype, hilite, typos,
+			      collisionp);
+      if (ro._M_pngp)
+	rasterize_svg(obj, ro);
+    }
+}
+
+
+/// Render one csv file @idata to svg, as above.
+void
+render_radial_uno(const string& idata, const string& imetrictype,
+		  const string& hilite, const uno_typography& typos,
+		  const raster_options& ro = raster_options(),
+		  const svg_stream_options& so = svg_stream_options(),
+		  const bool collisionp = false)
+{
+  const radial_dataset data(idata, metric_type_scale(imetrictype));
+  const environment env = deserialize_environment(idata);
+  render_radial_uno(file_path_to_stem(idata), data, env, imetrictype,
+		    hilite, typos, ro, so, collisionp);
+}
+
 } // namespace moz
 
 #endif
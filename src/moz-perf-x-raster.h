@@ -0,0 +1,194 @@
+// mozilla svg to png rasterization -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_RASTER_H
+#define moz_X_RASTER_H 1
+
+#include <cairo.h>
+#include <librsvg/rsvg.h>
+
+#include "moz-perf-x-svg.h"
+
+
+namespace moz {
+
+namespace constants {
+  constexpr const char* png_ext = ".png";
+
+  // Pixels per inch of svg user units, as inkscape and librsvg.
+  constexpr double svg_dpi = 96;
+}
+
+
+/**
+   PNG output of rendered svg, as with the inkscape flags in
+   scripts/svg-dir-to-pngs.sh:
+
+   --export-dpi=90 --export-background-opacity=1.0 --export-background=white
+
+   Off unless --png is given.
+*/
+struct raster_options
+{
+  bool		_M_pngp = false;
+  double	_M_dpi = 90;
+  string	_M_background = "white";
+  double	_M_opacity = 1.0;
+};
+
+
+/// Take the raster flags out of @argv, and return them as options.
+raster_options
+strip_raster_flags(int& argc, char* argv[])
+{
+  raster_options ro;
+  int nargs(1);
+  for (int i = 1; i < argc; ++i)
+    {
+      const string arg(argv[i]);
+      auto valuef = [&arg](const string& flag)
+      { return arg.substr(flag.size()); };
+      if (arg == "--png")
+	ro._M_pngp = true;
+      else if (arg.rfind("--export-dpi=", 0) == 0)
+	ro._M_dpi = std::stod(valuef("--export-dpi="));
+      else if (arg.rfind("--export-background=", 0) == 0)
+	ro._M_background = valuef("--export-background=");
+      else if (arg.rfind("--export-background-opacity=", 0) == 0)
+	ro._M_opacity = std::stod(valuef("--export-background-opacity="));
+      else
+	argv[nargs++] = argv[i];
+    }
+  argc = nargs;
+  return ro;
+}
+
+
+/// Background color @name, as white, black, #rgb, or #rrggbb, to
+/// red, green, blue in [0, 1]. Throws if not one of these.
+std::array<double, 3>
+parse_raster_color(const string& name)
+{
+  if (name == "white")
+    return { 1, 1, 1 };
+  if (name == "black")
+    return { 0, 0, 0 };
+
+  const bool shortp = name.size() == 4;
+  if (name.size() > 1 && name[0] == '#' && (shortp || name.size() == 7))
+    {
+      std::array<double, 3> rgb;
+      const uint w = shortp ? 1 : 2;
+      for (uint i = 0; i < 3; ++i)
+	{
+	  uint c(0);
+	  const char* first = name.data() + 1 + i * w;
+	  auto [ ptr, ec ] = std::from_chars(first, first + w, c, 16);
+	  if (ec != std::errc() || ptr != first + w)
+	    break;
+	  rgb[i] = (shortp ? c * 17 : c) / 255.0;
+	  if (i == 2)
+	    return rgb;
+	}
+    }
+  throw std::runtime_error(k::errorprefix + "parse_raster_color:: "
+			   + "unknown color " + name);
+}
+
+
+/// Complete svg document of @obj, as it will be written when done.
+string
+svg_document(const svg_element& obj)
+{ return obj.str() + "</svg>" + k::newline; }
+
+
+/**
+   Rasterize svg document @svg, of @width by @height user units, to
+   png file @ofile, with librsvg and cairo. No separate process, and
+   the document is parsed from memory, not from the svg file.
+
+   Each call has its own handle and surface, so calls on many threads
+   at once are fine.
+*/
+void
+rasterize_svg(const string& svg, const double width, const double height,
+	      const string& ofile, const raster_options& ro)
+{
+  GError* err = nullptr;
+  const guint8* data = reinterpret_cast<const guint8*>(svg.data());
+  RsvgHandle* handle = rsvg_handle_new_from_data(data, svg.size(), &err);
+  if (!handle)
+    {
+      string m(k::errorprefix + "rasterize_svg:: cannot parse svg for "
+	       + ofile);
+      if (err)
+	{
+	  m += string(": ") + err->message;
+	  g_error_free(err);
+	}
+      throw std::runtime_error(m);
+    }
+  rsvg_handle_set_dpi(handle, ro._M_dpi);
+
+  const double scale = ro._M_dpi / k::svg_dpi;
+  const int pw = std::max(1, int(std::lround(width * scale)));
+  const int ph = std::max(1, int(std::lround(height * scale)));
+  cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							pw, ph);
+  cairo_t* cr = cairo_create(surface);
+
+  const auto [ r, g, b ] = parse_raster_color(ro._M_background);
+  cairo_set_source_rgba(cr, r, g, b, ro._M_opacity);
+  cairo_paint(cr);
+
+  const RsvgRectangle viewport = { 0, 0, double(pw), double(ph) };
+  const bool renderedp = rsvg_handle_render_document(handle, cr, &viewport,
+						     &err);
+  cairo_status_t status = CAIRO_STATUS_SUCCESS;
+  if (renderedp)
+    status = cairo_surface_write_to_png(surface, ofile.c_str());
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  g_object_unref(handle);
+
+  if (!renderedp)
+    {
+      string m(k::errorprefix + "rasterize_svg:: cannot render " + ofile);
+      if (err)
+	{
+	  m += string(": ") + err->message;
+	  g_error_free(err);
+	}
+      throw std::runtime_error(m);
+    }
+  if (status != CAIRO_STATUS_SUCCESS)
+    throw std::runtime_error(k::errorprefix + "rasterize_svg:: cannot write "
+			     + ofile + ": " + cairo_status_to_string(status));
+}
+
+
+/// Rasterize @obj, as rendered so far, to png file named for it.
+void
+rasterize_svg(const svg_element& obj, const raster_options& ro)
+{
+  rasterize_svg(svg_document(obj), obj._M_area._M_width,
+		obj._M_area._M_height, obj._M_name + k::png_ext, ro);
+}
+
+} // namespace moz
+#endif
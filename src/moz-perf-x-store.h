@@ -0,0 +1,480 @@
+// mozilla columnar binary metric store -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_STORE_H
+#define moz_X_STORE_H 1
+
+#include <array>
+#include <cstring>
+#include <iostream>
+
+#include "moz-perf-x-csv.h"
+
+
+namespace moz {
+
+/**
+   Columnar binary store of extracted metrics, for many runs in one
+   file that is read with a single memory mapping.
+
+   A run is one extracted input file: its metric rows, plus its
+   environment. Rows are stored as columns of metric id, run id,
+   value, stddev, mdev and field count. Strings (metric names, run
+   names, environment values) are interned once per store, and so
+   are environments, which runs refer to by id.
+
+   Layout, all native little-endian, with every section padded to a
+   multiple of 8 bytes so that columns of doubles are aligned:
+
+   header	"mozpxms1", uint32 version, uint32 zero
+   block...	one per append
+
+   block header	"MPXB", uint32 nstrings, nenvs, nruns, nrows, zero,
+		uint64 block size in bytes, including this header
+   strings	uint32 offsets[nstrings + 1], then chars
+   envs		uint32[nenvs][14], 11 string ids then hw_cpu, hw_mem,
+		uri_count
+   runs		uint32[nruns][2], name string id then env id
+   rows		uint32 metric[nrows], uint32 run[nrows], double
+		value[nrows], stddev[nrows], mdev[nrows], uint8
+		nfields[nrows]
+
+   Each block only holds the strings, environments, and runs not
+   already in an earlier block, and ids count on from there. Appends
+   are not safe against another process appending at the same time.
+*/
+namespace constants {
+  constexpr const char* store_ext = ".mpxs";
+  constexpr const char store_magic[8] =
+    { 'm', 'o', 'z', 'p', 'x', 'm', 's', '1' };
+  constexpr const char store_block_magic[4] = { 'M', 'P', 'X', 'B' };
+  constexpr uint32_t store_version = 1;
+}
+
+
+struct store_header
+{
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	zero;
+};
+
+struct store_block_header
+{
+  char		magic[4];
+  uint32_t	nstrings;
+  uint32_t	nenvs;
+  uint32_t	nruns;
+  uint32_t	nrows;
+  uint32_t	zero;
+  uint64_t	size;
+};
+
+/// Environment as string ids and integers.
+using store_env = std::array<uint32_t, 14>;
+
+/// Run as name string id and environment id.
+using store_run = std::array<uint32_t, 2>;
+
+
+constexpr size_t
+store_pad(const size_t n)
+{ return (n + 7) & ~size_t(7); }
+
+
+/// Environment string fields, in store_env order.
+template<typename _Env>
+auto
+environment_strings(_Env& env) -> std::array<decltype(&env.url), 11>
+{
+  return { &env.os_vendor, &env.os_name, &env.os_version, &env.os_locale,
+	   &env.hw_name, &env.sw_name, &env.sw_arch, &env.sw_version,
+	   &env.sw_build_id, &env.url, &env.date_time_stamp };
+}
+
+
+/// Read-only view of a store file, memory mapped.
+struct metric_store
+{
+  struct block
+  {
+    const uint32_t*	metric;
+    const uint32_t*	run;
+    const double*	value;
+    const double*	stddev;
+    const double*	mdev;
+    const uint8_t*	nfields;
+    uint32_t		nrows;
+  };
+
+  /// Rows of one run, which are contiguous in one block.
+  struct run_rows
+  {
+    uint32_t	block;
+    uint32_t	first;
+    uint32_t	count;
+  };
+
+  static constexpr uint npos = -1;
+
+  mapped_file				_M_file;
+  std::vector<std::string_view>		_M_strings;
+  std::vector<store_env>		_M_envs;
+  std::vector<store_run>		_M_runs;
+  std::vector<run_rows>			_M_run_rows;
+  std::vector<block>			_M_blocks;
+
+  metric_store() = default;
+
+  explicit
+  metric_store(const string& ifile) : _M_file(ifile)
+  {
+    const char* const start = _M_file.data();
+    const char* const end = start + _M_file.size();
+    auto fail = [&ifile](const char* m)
+    {
+      string s(k::errorprefix + "metric_store:: ");
+      s += m;
+      s += ": ";
+      s += ifile;
+      throw std::runtime_error(s);
+    };
+
+    store_header h;
+    if (_M_file.size() < sizeof(h))
+      fail("not a store");
+    std::memcpy(&h, start, sizeof(h));
+    if (std::memcmp(h.magic, k::store_magic, sizeof(h.magic)) != 0
+	|| h.version != k::store_version)
+      fail("not a store, or wrong version");
+
+    const char* p = start + sizeof(h);
+    while (p != end)
+      {
+	store_block_header bh;
+	if (size_t(end - p) < sizeof(bh))
+	  fail("truncated block");
+	std::memcpy(&bh, p, sizeof(bh));
+	if (std::memcmp(bh.magic, k::store_block_magic, 4) != 0
+	    || bh.size > size_t(end - p) || bh.size < sizeof(bh))
+	  fail("bad block");
+	const char* const bend = p + bh.size;
+	const char* q = p + sizeof(bh);
+
+	// Bounds-checked advance through the block.
+	auto take = [&](const size_t n)
+	{
+	  if (n > size_t(bend - q))
+	    fail("block overrun");
+	  const char* r = q;
+	  q += store_pad(n);
+	  if (q > bend)
+	    q = bend;
+	  return r;
+	};
+
+	// Strings.
+	const size_t noffsets = size_t(bh.nstrings) + 1;
+	auto offsets = reinterpret_cast<const uint32_t*>
+	  (take(noffsets * sizeof(uint32_t)));
+	const char* chars = take(offsets[bh.nstrings]);
+	for (uint32_t i = 0; i < bh.nstrings; ++i)
+	  {
+	    if (offsets[i] > offsets[i + 1])
+	      fail("bad string table");
+	    _M_strings.emplace_back(chars + offsets[i],
+				    offsets[i + 1] - offsets[i]);
+	  }
+
+	// Environments and runs.
+	auto envs = reinterpret_cast<const store_env*>
+	  (take(bh.nenvs * sizeof(store_env)));
+	_M_envs.insert(_M_envs.end(), envs, envs + bh.nenvs);
+	auto runs = reinterpret_cast<const store_run*>
+	  (take(bh.nruns * sizeof(store_run)));
+	_M_runs.insert(_M_runs.end(), runs, runs + bh.nruns);
+
+	// Columns.
+	block b;
+	b.nrows = bh.nrows;
+	b.metric = reinterpret_cast<const uint32_t*>(take(b.nrows * 4));
+	b.run = reinterpret_cast<const uint32_t*>(take(b.nrows * 4));
+	b.value = reinterpret_cast<const double*>(take(b.nrows * 8));
+	b.stddev = reinterpret_cast<const double*>(take(b.nrows * 8));
+	b.mdev = reinterpret_cast<const double*>(take(b.nrows * 8));
+	b.nfields = reinterpret_cast<const uint8_t*>(take(b.nrows));
+	_M_blocks.push_back(b);
+	p = bend;
+      }
+
+    // Check ids, and find the rows of each run.
+    for (const store_env& e : _M_envs)
+      for (uint i = 0; i < 11; ++i)
+	if (e[i] >= _M_strings.size())
+	  fail("bad environment");
+    for (const store_run& r : _M_runs)
+      if (r[0] >= _M_strings.size() || r[1] >= _M_envs.size())
+	fail("bad run");
+
+    _M_run_rows.assign(_M_runs.size(), run_rows { 0, 0, 0 });
+    for (uint32_t bi = 0; bi < _M_blocks.size(); ++bi)
+      {
+	const block& b = _M_blocks[bi];
+	for (uint32_t i = 0; i < b.nrows; ++i)
+	  {
+	    if (b.metric[i] >= _M_strings.size() || b.run[i] >= _M_runs.size())
+	      fail("bad row");
+	    run_rows& rr = _M_run_rows[b.run[i]];
+	    if (rr.count == 0)
+	      rr = { bi, i, 0 };
+	    ++rr.count;
+	  }
+      }
+  }
+
+  metric_store(metric_store&&) = default;
+
+  size_t
+  size() const
+  { return _M_runs.size(); }
+
+  std::string_view
+  run_name(const uint run) const
+  { return _M_strings[_M_runs[run][0]]; }
+
+  /// Most recently appended run named @name, or npos.
+  uint
+  find_run(std::string_view name) const
+  {
+    for (uint run = _M_runs.size(); run > 0; --run)
+      if (run_name(run - 1) == name)
+	return run - 1;
+    return npos;
+  }
+
+  environment
+  run_environment(const uint run) const
+  {
+    const store_env& e = _M_envs[_M_runs[run][1]];
+    environment env = { };
+    auto fields = environment_strings(env);
+    for (uint i = 0; i < fields.size(); ++i)
+      *fields[i] = string(_M_strings[e[i]]);
+    env.hw_cpu = e[11];
+    env.hw_mem = e[12];
+    env.uri_count = e[13];
+    return env;
+  }
+
+  /// Rows of @run, with names pointing into the mapping.
+  csv_rows
+  rows(const uint run) const
+  {
+    const run_rows& rr = _M_run_rows[run];
+    csv_rows ret;
+    ret.reserve(rr.count);
+    if (rr.count > 0)
+      {
+	const block& b = _M_blocks[rr.block];
+	for (uint32_t i = rr.first; i < rr.first + rr.count; ++i)
+	  {
+	    csv_row row;
+	    row.name = _M_strings[b.metric[i]];
+	    row.value = b.value[i];
+	    row.stddev = b.stddev[i];
+	    row.mdev = b.mdev[i];
+	    row.nfields = b.nfields[i];
+	    ret.push_back(row);
+	  }
+      }
+    return ret;
+  }
+};
+
+
+/**
+   Appends runs to a store file, as one new block per flush.
+
+   Strings and environments already in the store are not written
+   again. Runs can be added from many threads.
+*/
+struct metric_store_writer
+{
+  const string					_M_ofile;
+  std::mutex					_M_mutex;
+
+  std::unordered_map<string, uint32_t>		_M_string_ids;
+  std::unordered_map<string, uint32_t>		_M_env_ids;
+  uint32_t					_M_nruns;
+
+  // Pending block.
+  strings					_M_strings;
+  std::vector<store_env>			_M_envs;
+  std::vector<store_run>			_M_runs;
+  std::vector<uint32_t>				_M_metric;
+  std::vector<uint32_t>				_M_run;
+  std::vector<double>				_M_value;
+  std::vector<double>				_M_stddev;
+  std::vector<double>				_M_mdev;
+  std::vector<uint8_t>				_M_nfields;
+
+  explicit
+  metric_store_writer(const string& ofile) : _M_ofile(ofile), _M_nruns(0)
+  {
+    // Intern tables continue from an existing store.
+    if (filesystem::exists(ofile) && filesystem::file_size(ofile) > 0)
+      {
+	const metric_store store(ofile);
+	for (uint32_t i = 0; i < store._M_strings.size(); ++i)
+	  _M_string_ids.emplace(string(store._M_strings[i]), i);
+	for (uint32_t i = 0; i < store._M_envs.size(); ++i)
+	  _M_env_ids.emplace(env_key(store._M_envs[i]), i);
+	_M_nruns = store.size();
+      }
+  }
+
+  metric_store_writer(const metric_store_writer&) = delete;
+  metric_store_writer& operator=(const metric_store_writer&) = delete;
+
+  ~metric_store_writer()
+  {
+    try
+      {
+	flush();
+      }
+    catch (const std::exception& e)
+      {
+	std::cerr << e.what() << std::endl;
+      }
+  }
+
+  /// Add run named @name, with environment @env and metric @rows.
+  void
+  add_run(const string& name, const environment& env, const csv_rows& rows)
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+
+    store_env e = { };
+    auto fields = environment_strings(env);
+    for (uint i = 0; i < fields.size(); ++i)
+      e[i] = intern(*fields[i]);
+    e[11] = env.hw_cpu;
+    e[12] = env.hw_mem;
+    e[13] = env.uri_count;
+
+    auto [ ienv, newp ] = _M_env_ids.emplace(env_key(e), _M_env_ids.size());
+    if (newp)
+      _M_envs.push_back(e);
+
+    const uint32_t run = _M_nruns++;
+    _M_runs.push_back({ intern(name), ienv->second });
+    for (const csv_row& row : rows)
+      {
+	_M_metric.push_back(intern(string(row.name)));
+	_M_run.push_back(run);
+	_M_value.push_back(row.value);
+	_M_stddev.push_back(row.stddev);
+	_M_mdev.push_back(row.mdev);
+	_M_nfields.push_back(row.nfields);
+      }
+  }
+
+  /// Append pending runs to the store file as one block.
+  void
+  flush()
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    if (_M_runs.empty())
+      return;
+
+    string b(sizeof(store_block_header), '\0');
+    auto put = [&b](const void* data, const size_t n)
+    {
+      b.append(static_cast<const char*>(data), n);
+      b.resize(store_pad(b.size()));
+    };
+
+    std::vector<uint32_t> offsets(1, 0);
+    string chars;
+    for (const string& s : _M_strings)
+      {
+	chars += s;
+	offsets.push_back(chars.size());
+      }
+    put(offsets.data(), offsets.size() * sizeof(uint32_t));
+    put(chars.data(), chars.size());
+    put(_M_envs.data(), _M_envs.size() * sizeof(store_env));
+    put(_M_runs.data(), _M_runs.size() * sizeof(store_run));
+    put(_M_metric.data(), _M_metric.size() * 4);
+    put(_M_run.data(), _M_run.size() * 4);
+    put(_M_value.data(), _M_value.size() * 8);
+    put(_M_stddev.data(), _M_stddev.size() * 8);
+    put(_M_mdev.data(), _M_mdev.size() * 8);
+    put(_M_nfields.data(), _M_nfields.size());
+
+    store_block_header bh = { };
+    std::memcpy(bh.magic, k::store_block_magic, 4);
+    bh.nstrings = _M_strings.size();
+    bh.nenvs = _M_envs.size();
+    bh.nruns = _M_runs.size();
+    bh.nrows = _M_metric.size();
+    bh.size = b.size();
+    std::memcpy(b.data(), &bh, sizeof(bh));
+
+    const bool newp = !filesystem::exists(_M_ofile)
+      || filesystem::file_size(_M_ofile) == 0;
+    std::ofstream ofs(_M_ofile, std::ios_base::app | std::ios_base::binary);
+    if (newp)
+      {
+	store_header h = { };
+	std::memcpy(h.magic, k::store_magic, sizeof(h.magic));
+	h.version = k::store_version;
+	ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      }
+    ofs.write(b.data(), b.size());
+    if (!ofs.good())
+      throw std::runtime_error(k::errorprefix + "metric_store_writer:: write "
+			       + _M_ofile);
+
+    _M_strings.clear();
+    _M_envs.clear();
+    _M_runs.clear();
+    _M_metric.clear();
+    _M_run.clear();
+    _M_value.clear();
+    _M_stddev.clear();
+    _M_mdev.clear();
+    _M_nfields.clear();
+  }
+
+private:
+  uint32_t
+  intern(const string& s)
+  {
+    auto [ i, newp ] = _M_string_ids.emplace(s, _M_string_ids.size());
+    if (newp)
+      _M_strings.push_back(s);
+    return i->second;
+  }
+
+  static string
+  env_key(const store_env& e)
+  { return string(reinterpret_cast<const char*>(e.data()), sizeof(e)); }
+};
+
+} // namespace moz
+#endif
@@ -21,6 +21,7 @@
 #include "a60-svg.h"
 #include "a60-svg-radial.h"
 #include "moz-perf-x.h"
+#include "moz-perf-x-compress.h"
 
 
 namespace moz {
@@ -29,6 +30,211 @@ namespace moz {
 using namespace svg;
 
 
+/// Streaming svg output, off unless --svg-stream or --svgz is given.
+struct svg_stream_options
+{
+  bool		_M_streamp = false;
+  bool		_M_gzipp = false;
+  size_t	_M_capacity = 64 * 1024;
+};
+
+
+/// Take the svg stream flags out of @argv, and return them as options.
+svg_stream_options
+strip_svg_stream_flags(int& argc, char* argv[])
+{
+  svg_stream_options so;
+  int nargs(1);
+  for (int i = 1; i < argc; ++i)
+    {
+      const string arg(argv[i]);
+      if (arg == "--svg-stream")
+	so._M_streamp = true;
+      else if (arg == "--svgz")
+	so._M_streamp = so._M_gzipp = true;
+      else
+	argv[nargs++] = argv[i];
+    }
+  argc = nargs;
+  return so;
+}
+
+
+/**
+   Svg document @ofstem written as it is made, instead of all at once
+   when done. The svg_element only holds what has been added since the
+   last drain, and each drain moves that through a fixed-size buffer to
+   the file, gzip compressed as @ofstem.svgz if @gzipp. Memory use is
+   then bounded by what is added between drains: flat, whatever the
+   number of probes, when each label is drained as it is placed, as
+   render_radial_labels does. The kusama labels of render_radial are
+   added all at once, and so are all held until one drain after.
+
+   The moz helpers that add elements (place_text_at_point,
+   place_text_id, render_metadata, add_svg_layer) drain after each
+   element, when adding to the svg_element of the active stream on
+   this thread. Call drain_svg after adding elements by other means.
+*/
+struct svg_stream
+{
+  svg_element		_M_obj;
+  buffered_file_sink	_M_sink;
+  svg_stream*		_M_prev;
+  bool			_M_finishedp;
+
+  svg_stream(const string& ofstem, const area<>& a, const bool gzipp,
+	     const size_t capacity = 64 * 1024)
+  : _M_obj(ofstem, a, false),
+    _M_sink(ofstem + (gzipp ? k::analyze_gz_ext : k::analyze_ext), gzipp,
+	    capacity),
+    _M_prev(active()), _M_finishedp(false)
+  {
+    // Not written on destruction, so start the document here.
+    _M_obj.start();
+    _M_obj.start_element();
+    active() = this;
+    drain();
+  }
+
+  svg_stream(const svg_stream&) = delete;
+  svg_stream& operator=(const svg_stream&) = delete;
+
+  ~svg_stream()
+  {
+    try
+      {
+	finish();
+      }
+    catch (const std::exception& e)
+      {
+	std::cerr << e.what() << std::endl;
+      }
+  }
+
+  /// Stream on this thread whose svg_element is drained by the helpers.
+  static svg_stream*&
+  active()
+  {
+    thread_local svg_stream* stream = nullptr;
+    return stream;
+  }
+
+  /// Move the elements added so far to the sink.
+  void
+  drain()
+  {
+    _M_sink.write(_M_obj.str());
+    _M_obj.str(string());
+  }
+
+  /// End the document and close the file.
+  void
+  finish()
+  {
+    if (_M_finishedp)
+      return;
+    _M_finishedp = true;
+    if (active() == this)
+      active() = _M_prev;
+    _M_obj.finish_element();
+    drain();
+    _M_sink.close();
+  }
+};
+
+
+/// Drain @obj to its stream, if it is the active one on this thread.
+void
+drain_svg(svg_element& obj)
+{
+  svg_stream* stream = svg_stream::active();
+  if (stream && &stream->_M_obj == &obj)
+    stream->drain();
+}
+
+
+/**
+   Cache of static svg layers: fragments that are the same in every
+   chart of one canvas size, like the canvas group and the direction
+   arc. Each is rendered once into a scratch svg_element, kept as
+   serialized markup, and then spliced into each chart as is.
+
+   Renders run in parallel, so lookups are locked. A layer is made at
+   most once, by the first render to ask for it.
+*/
+struct svg_layer_cache
+{
+  std::mutex				_M_mutex;
+  std::unordered_map<string, string>	_M_layers;
+
+  static svg_layer_cache&
+  get()
+  {
+    static svg_layer_cache cache;
+    return cache;
+  }
+
+  /// Layer @key on canvas @a, rendered by @renderf if not cached.
+  template<typename _Fn>
+  const string&
+  layer(const string& key, const area<>& a, _Fn renderf)
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    auto i = _M_layers.find(key);
+    if (i == _M_layers.end())
+      {
+	// Not a document: no svg header, footer, or file written.
+	svg_element scratch(key, a, false);
+	renderf(scratch);
+	i = _M_layers.emplace(key, scratch.str()).first;
+      }
+    return i->second;
+  }
+};
+
+
+/// Add static layer @key to @obj, rendered by @renderf the first time
+/// for this canvas size. The key must name everything the layer
+/// depends on besides the canvas size.
+template<typename _Fn>
+void
+add_svg_layer(svg_element& obj, const string& key, _Fn renderf)
+{
+  const area<>& a = obj._M_area;
+  const string akey = key + k::hypen + to_string(a._M_width) + "x"
+    + to_string(a._M_height);
+  obj.add_raw(svg_layer_cache::get().layer(akey, a, renderf));
+  drain_svg(obj);
+}
+
+
+/// Key for style @styl, for add_svg_layer.
+string
+style_layer_key(const style& styl)
+{
+  std::ostringstream oss;
+  oss << static_cast<int>(styl._M_fill_color) << k::comma
+      << styl._M_fill_opacity << k::comma
+      << static_cast<int>(styl._M_stroke_color) << k::comma
+      << styl._M_stroke_opacity << k::comma << styl._M_stroke_size;
+  return oss.str();
+}
+
+
+/// Add the canvas group that starts every chart.
+void
+add_canvas_layer(svg_element& obj)
+{
+  add_svg_layer(obj, "initialize_svg", [](svg_element& layer)
+  {
+    group_element g;
+    g.start_element("mozilla viz experiment 20200724.v6");
+    g.finish_element();
+    layer.add_element(g);
+  });
+}
+
+
 // Create an svg object with 1080p dimensions and return it.
 svg_element
 initialize_svg(const string ofile = "moz-telemetry-radiating-lines",
@@ -36,12 +242,7 @@ initialize_svg(const string ofile = "moz-telemetry-radiating-lines",
 {
   area<> a = { width, height };
   svg_element obj(ofile, a);
-
-  group_element g;
-  g.start_element("mozilla viz experiment 20200724.v6");
-  g.finish_element();
-  obj.add_element(g);
-
+  add_canvas_layer(obj);
   return obj;
 }
 
@@ -110,6 +311,7 @@ place_text_at_point(svg_element& obj, const typography& typo,
   t.add_data(dt);
   t.finish_element();
   obj.add_element(t);
+  drain_svg(obj);
 }
 
 
@@ -129,6 +331,7 @@ place_text_id(svg_element& obj, const typography& typo, string label,
 
   t.finish_element();
   obj.add_element(t);
+  drain_svg(obj);
 }
 
 
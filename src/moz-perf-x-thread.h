@@ -0,0 +1,373 @@
+// mozilla work-stealing thread pool -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_THREAD_H
+#define moz_X_THREAD_H 1
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+/**
+   Fixed-size pool of worker threads, with one task deque per worker.
+
+   Workers run tasks from the back of their own deque, and when that
+   is empty steal from the front of the other deques. Tasks submitted
+   from a worker go on that worker's deque, tasks submitted from
+   elsewhere are dealt out to the deques round-robin.
+*/
+struct thread_pool
+{
+  using task = std::function<void()>;
+
+  struct task_deque
+  {
+    std::mutex		_M_mutex;
+    std::deque<task>	_M_tasks;
+  };
+
+  std::vector<std::unique_ptr<task_deque>>	_M_deques;
+  std::vector<std::thread>			_M_threads;
+
+  // Sleep/wake for idle workers, guards _M_stop.
+  std::mutex					_M_mutex;
+  std::condition_variable			_M_cv;
+  std::atomic<uint>				_M_queued;
+  std::atomic<uint>				_M_next;
+  bool						_M_stop;
+
+  explicit
+  thread_pool(const uint n = std::thread::hardware_concurrency())
+  : _M_queued(0), _M_next(0), _M_stop(false)
+  {
+    const uint nthreads = std::max(1u, n);
+    for (uint i = 0; i < nthreads; ++i)
+      _M_deques.push_back(std::make_unique<task_deque>());
+    for (uint i = 0; i < nthreads; ++i)
+      _M_threads.emplace_back([this, i] { work(i); });
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  /// Finishes all queued tasks, then joins the workers.
+  ~thread_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_M_mutex);
+      _M_stop = true;
+    }
+    _M_cv.notify_all();
+    for (std::thread& t : _M_threads)
+      t.join();
+  }
+
+  // Fixed before any worker starts.
+  uint
+  size() const
+  { return _M_deques.size(); }
+
+  /// Index of the calling thread in this pool, or size() if not a worker.
+  uint
+  self() const
+  {
+    const auto& [ pool, index ] = current();
+    return pool == this ? index : size();
+  }
+
+  void
+  submit(task t)
+  {
+    uint i = self();
+    if (i == size())
+      i = _M_next++ % size();
+
+    task_deque& q = *_M_deques[i];
+    {
+      std::lock_guard<std::mutex> lock(q._M_mutex);
+      q._M_tasks.push_back(std::move(t));
+    }
+    {
+      std::lock_guard<std::mutex> lock(_M_mutex);
+      ++_M_queued;
+    }
+    _M_cv.notify_one();
+  }
+
+  /// Run one queued task, own deque first then steal. False if none.
+  bool
+  try_run_one()
+  {
+    const uint n = size();
+    const uint start = self() < n ? self() : _M_next % n;
+
+    task t;
+    for (uint j = 0; j < n && !t; ++j)
+      {
+	task_deque& q = *_M_deques[(start + j) % n];
+	std::lock_guard<std::mutex> lock(q._M_mutex);
+	if (!q._M_tasks.empty())
+	  {
+	    if (j == 0)
+	      {
+		t = std::move(q._M_tasks.back());
+		q._M_tasks.pop_back();
+	      }
+	    else
+	      {
+		t = std::move(q._M_tasks.front());
+		q._M_tasks.pop_front();
+	      }
+	  }
+      }
+
+    if (t)
+      {
+	--_M_queued;
+	t();
+      }
+    return bool(t);
+  }
+
+private:
+  static std::pair<const thread_pool*, uint>&
+  current()
+  {
+    static thread_local std::pair<const thread_pool*, uint> worker;
+    return worker;
+  }
+
+  void
+  work(const uint i)
+  {
+    current() = { this, i };
+    while (true)
+      {
+	if (try_run_one())
+	  continue;
+
+	std::unique_lock<std::mutex> lock(_M_mutex);
+	_M_cv.wait(lock, [this] { return _M_stop || _M_queued > 0; });
+	if (_M_stop && _M_queued == 0)
+	  break;
+      }
+  }
+};
+
+
+/// Pool shared by all parallel work in a program, made on first use,
+/// so that nested parallel work runs on the same threads.
+thread_pool&
+shared_thread_pool()
+{
+  static thread_pool pool;
+  return pool;
+}
+
+
+/**
+   Set of tasks run on a thread_pool that are waited on together.
+
+   Tasks are queued on the group, and the pool is given one task per
+   group task that runs the next one still queued. While waiting, the
+   calling thread runs queued tasks of this group only, never other
+   pool work: a task can itself start and wait on a nested task_group
+   without deadlock, and waiting does not pick up unrelated work. The
+   first exception thrown by a task is re-thrown by wait.
+*/
+struct task_group
+{
+  using task = std::function<void()>;
+
+  // Shared with the pool tasks, which may run after the group is done.
+  struct queue
+  {
+    std::mutex			_M_mutex;
+    std::condition_variable	_M_cv;
+    std::deque<task>		_M_tasks;
+    uint			_M_pending = 0;
+    std::exception_ptr		_M_error;
+
+    /// Run the next queued task. False if none.
+    bool
+    try_run_one()
+    {
+      task t;
+      {
+	std::lock_guard<std::mutex> lock(_M_mutex);
+	if (_M_tasks.empty())
+	  return false;
+	t = std::move(_M_tasks.front());
+	_M_tasks.pop_front();
+      }
+
+      std::exception_ptr e;
+      try
+	{
+	  t();
+	}
+      catch (...)
+	{
+	  e = std::current_exception();
+	}
+
+      std::lock_guard<std::mutex> lock(_M_mutex);
+      if (e && !_M_error)
+	_M_error = e;
+      if (--_M_pending == 0)
+	_M_cv.notify_all();
+      return true;
+    }
+  };
+
+  thread_pool&			_M_pool;
+  std::shared_ptr<queue>	_M_queue;
+
+  explicit
+  task_group(thread_pool& pool)
+  : _M_pool(pool), _M_queue(std::make_shared<queue>()) { }
+
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+  ~task_group()
+  { join(); }
+
+  void
+  run(task fn)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_M_queue->_M_mutex);
+      _M_queue->_M_tasks.push_back(std::move(fn));
+      ++_M_queue->_M_pending;
+    }
+    _M_pool.submit([q = _M_queue] { q->try_run_one(); });
+  }
+
+  void
+  wait()
+  {
+    join();
+    std::lock_guard<std::mutex> lock(_M_queue->_M_mutex);
+    if (_M_queue->_M_error)
+      std::rethrow_exception(std::exchange(_M_queue->_M_error, nullptr));
+  }
+
+private:
+  // Run this group's queued tasks, then wait for the ones running.
+  void
+  join()
+  {
+    queue& q = *_M_queue;
+    while (q.try_run_one())
+      { }
+
+    std::unique_lock<std::mutex> lock(q._M_mutex);
+    q._M_cv.wait(lock, [&q] { return q._M_pending == 0; });
+  }
+};
+
+
+/// Run @fn on each of @items, in parallel on @pool, and wait.
+template<typename _Items, typename _Fn>
+void
+parallel_for_each(thread_pool& pool, const _Items& items, _Fn fn)
+{
+  task_group tasks(pool);
+  for (const auto& item : items)
+    tasks.run([&fn, &item] { fn(item); });
+  tasks.wait();
+}
+
+
+
+/**
+   First in first out queue holding at most @capacity items, to pass
+   work between threads with backpressure: push waits while the queue
+   is full, and pop waits while it is empty. After close, push fails
+   and pop drains what is left, then fails.
+*/
+template<typename _Tp>
+struct bounded_queue
+{
+  std::mutex			_M_mutex;
+  std::condition_variable	_M_not_full;
+  std::condition_variable	_M_not_empty;
+  std::deque<_Tp>		_M_items;
+  const size_t			_M_capacity;
+  bool				_M_closed;
+
+  explicit
+  bounded_queue(const size_t capacity)
+  : _M_capacity(std::max(capacity, size_t(1))), _M_closed(false)
+  { }
+
+  bounded_queue(const bounded_queue&) = delete;
+  bounded_queue& operator=(const bounded_queue&) = delete;
+
+  bool
+  push(_Tp item)
+  {
+    std::unique_lock<std::mutex> lock(_M_mutex);
+    _M_not_full.wait(lock, [this]
+    { return _M_closed || _M_items.size() < _M_capacity; });
+    if (_M_closed)
+      return false;
+    _M_items.push_back(std::move(item));
+    lock.unlock();
+    _M_not_empty.notify_one();
+    return true;
+  }
+
+  bool
+  pop(_Tp& item)
+  {
+    std::unique_lock<std::mutex> lock(_M_mutex);
+    _M_not_empty.wait(lock, [this] { return _M_closed || !_M_items.empty(); });
+    if (_M_items.empty())
+      return false;
+    item = std::move(_M_items.front());
+    _M_items.pop_front();
+    lock.unlock();
+    _M_not_full.notify_one();
+    return true;
+  }
+
+  void
+  close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_M_mutex);
+      _M_closed = true;
+    }
+    _M_not_full.notify_all();
+    _M_not_empty.notify_all();
+  }
+};
+
+} // namespace moz
+#endif
@@ -0,0 +1,267 @@
+// mozilla extraction timers and counters -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_TRACE_H
+#define moz_X_TRACE_H 1
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+/**
+   Instrumentation of extraction stages, off unless enabled.
+
+   A scoped_timer times one stage, from construction to destruction,
+   and holds counters for it: bytes read, DOM nodes, probes matched,
+   output bytes, and so on. Each finished stage is kept as an event,
+   and its time and counters are added to the totals for the stage
+   name. Free counters, not tied to one stage, add to the totals only.
+
+   When done, write either the totals as JSON, or the events in
+   Chrome trace format, for chrome://tracing or ui.perfetto.dev.
+
+   While disabled, timers and counters do nothing, so instrumented
+   code costs one test of a flag.
+*/
+struct trace_recorder
+{
+  using clock_type = std::chrono::steady_clock;
+  using counters = std::map<string, int64_t>;
+
+  struct event
+  {
+    string	name;
+    string	detail;
+    int64_t	start_us;
+    int64_t	dur_us;
+    size_t	tid;
+    counters	args;
+  };
+
+  struct total
+  {
+    uint	count = 0;
+    int64_t	dur_us = 0;
+    counters	args;
+  };
+
+  std::atomic<bool>		_M_enabledp = false;
+  const clock_type::time_point	_M_start = clock_type::now();
+  std::mutex			_M_mutex;
+  std::vector<event>		_M_events;
+  std::map<string, total>	_M_totals;
+
+  static trace_recorder&
+  get()
+  {
+    static trace_recorder recorder;
+    return recorder;
+  }
+
+  static bool
+  enabledp()
+  { return get()._M_enabledp.load(std::memory_order_relaxed); }
+
+  int64_t
+  now_us() const
+  {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(clock_type::now() - _M_start).count();
+  }
+
+  void
+  add(event&& e)
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    total& t = _M_totals[e.name];
+    ++t.count;
+    t.dur_us += e.dur_us;
+    for (const auto& [ key, n ] : e.args)
+      t.args[key] += n;
+    _M_events.push_back(std::move(e));
+  }
+
+  void
+  count(const string& stage, const string& key, const int64_t n)
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    _M_totals[stage].args[key] += n;
+  }
+
+  /// Totals per stage, as JSON object of stage name to count, time in
+  /// milliseconds, and counters.
+  void
+  write_totals(ostream& os)
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    os << '{' << k::newline;
+    uint i(0);
+    for (const auto& [ name, t ] : _M_totals)
+      {
+	os << "  " << k::quote << name << k::quote << ": { \"count\": "
+	   << t.count << ", \"ms\": " << t.dur_us / 1000.0;
+	for (const auto& [ key, n ] : t.args)
+	  os << ", " << k::quote << key << k::quote << ": " << n;
+	os << " }" << (++i < _M_totals.size() ? "," : "") << k::newline;
+      }
+    os << '}' << k::newline;
+  }
+
+  /// Events as Chrome trace format JSON, complete events with counters
+  /// as args.
+  void
+  write_chrome_trace(ostream& os)
+  {
+    std::lock_guard<std::mutex> lock(_M_mutex);
+    os << "{ \"traceEvents\": [" << k::newline;
+    for (uint i = 0; i < _M_events.size(); ++i)
+      {
+	const event& e = _M_events[i];
+	os << "  { \"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1"
+	   << ", \"tid\": " << e.tid << ", \"ts\": " << e.start_us
+	   << ", \"dur\": " << e.dur_us << ", \"args\": { ";
+	if (!e.detail.empty())
+	  os << "\"detail\": \"" << escape_json(e.detail) << "\""
+	     << (e.args.empty() ? "" : ", ");
+	uint j(0);
+	for (const auto& [ key, n ] : e.args)
+	  os << k::quote << key << "\": " << n
+	     << (++j < e.args.size() ? ", " : "");
+	os << " } }" << (i + 1 < _M_events.size() ? "," : "") << k::newline;
+      }
+    os << "] }" << k::newline;
+  }
+
+  /// Write to @ofile, Chrome trace format if @chromep, otherwise totals.
+  void
+  write(const string& ofile, const bool chromep)
+  {
+    std::ofstream ofs(ofile);
+    if (chromep)
+      write_chrome_trace(ofs);
+    else
+      write_totals(ofs);
+    if (!ofs.good())
+      std::cerr << k::errorprefix << "cannot write trace file " << ofile
+		<< std::endl;
+  }
+
+private:
+  static string
+  escape_json(const string& s)
+  {
+    string ret;
+    for (const char c : s)
+      {
+	if (c == '"' || c == '\\')
+	  ret += '\\';
+	if (static_cast<unsigned char>(c) >= 0x20)
+	  ret += c;
+      }
+    return ret;
+  }
+};
+
+
+/// Time and counters of one stage named @name, for input @detail.
+struct scoped_timer
+{
+  const bool			_M_enabledp;
+  trace_recorder::event		_M_event;
+
+  explicit
+  scoped_timer(const char* name, const string& detail = "")
+  : _M_enabledp(trace_recorder::enabledp())
+  {
+    if (_M_enabledp)
+      {
+	_M_event.name = name;
+	_M_event.detail = detail;
+	_M_event.start_us = trace_recorder::get().now_us();
+	_M_event.tid = std::hash<std::thread::id>()(std::this_thread::get_id())
+	  % 100000;
+      }
+  }
+
+  scoped_timer(const scoped_timer&) = delete;
+  scoped_timer& operator=(const scoped_timer&) = delete;
+
+  ~scoped_timer()
+  {
+    if (_M_enabledp)
+      {
+	trace_recorder& r = trace_recorder::get();
+	_M_event.dur_us = r.now_us() - _M_event.start_us;
+	r.add(std::move(_M_event));
+      }
+  }
+
+  bool
+  enabledp() const
+  { return _M_enabledp; }
+
+  void
+  count(const char* key, const int64_t n)
+  {
+    if (_M_enabledp)
+      _M_event.args[key] += n;
+  }
+};
+
+
+/// Enable recording for the life of this object, then write it to
+/// @ofile. Nothing is recorded if @ofile is empty.
+struct trace_session
+{
+  const string	_M_file;
+  const bool	_M_chromep;
+
+  trace_session(const string& ofile, const bool chromep)
+  : _M_file(ofile), _M_chromep(chromep)
+  { trace_recorder::get()._M_enabledp = !ofile.empty(); }
+
+  trace_session(const trace_session&) = delete;
+  trace_session& operator=(const trace_session&) = delete;
+
+  ~trace_session()
+  {
+    if (!_M_file.empty())
+      {
+	trace_recorder::get()._M_enabledp = false;
+	trace_recorder::get().write(_M_file, _M_chromep);
+      }
+  }
+};
+
+
+/// Add @n to counter @key in the totals for @stage.
+void
+trace_count(const char* stage, const char* key, const int64_t n)
+{
+  if (trace_recorder::enabledp())
+    trace_recorder::get().count(stage, key, n);
+}
+
+} // namespace moz
+#endif
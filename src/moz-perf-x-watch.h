@@ -0,0 +1,139 @@
+// mozilla results directory watch -*- mode: C++ -*-
+
+// Copyright (c) 2021, Mozilla
+// Benjamin De Kosnik <bdekoz@mozilla.com>
+
+// This file is part of the MOZILLA TELEMETRY X library.
+
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 3, or (at
+// your option) any later version.
+
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+#ifndef moz_X_WATCH_H
+#define moz_X_WATCH_H 1
+
+#include <iostream>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include "moz-perf-x.h"
+
+
+namespace moz {
+
+/**
+   Watch of directory @idir and all of its sub-directories with
+   inotify, for files that are finished: closed after writing, or
+   moved in. New sub-directories are watched as they are made, and
+   files already in them are reported, as they may have landed before
+   the watch was added.
+
+   If the kernel event queue overflows, because events were not read
+   fast enough, events are lost and overflowp is set: rescan the
+   whole tree.
+*/
+struct directory_watch
+{
+  int				_M_fd;
+  std::unordered_map<int, string>	_M_dirs;
+  bool				_M_overflowp;
+
+  explicit
+  directory_watch(const string& idir)
+  : _M_fd(::inotify_init1(IN_CLOEXEC | IN_NONBLOCK)), _M_overflowp(false)
+  {
+    if (_M_fd < 0)
+      throw std::runtime_error(k::errorprefix + "directory_watch:: "
+			       + "inotify_init1 failed");
+    strings ignored;
+    add(idir, ignored);
+  }
+
+  directory_watch(const directory_watch&) = delete;
+  directory_watch& operator=(const directory_watch&) = delete;
+
+  ~directory_watch()
+  { ::close(_M_fd); }
+
+  /// Wait at most @timeout milliseconds for events, then add the
+  /// paths of finished files to @files. False if nothing happened.
+  bool
+  wait(strings& files, const int timeout)
+  {
+    pollfd pfd = { _M_fd, POLLIN, 0 };
+    if (::poll(&pfd, 1, timeout) <= 0)
+      return false;
+
+    alignas(inotify_event) char buf[64 * 1024];
+    ssize_t n;
+    while ((n = ::read(_M_fd, buf, sizeof(buf))) > 0)
+      {
+	for (char* p = buf; p < buf + n; )
+	  {
+	    const inotify_event* ev = reinterpret_cast<inotify_event*>(p);
+	    p += sizeof(inotify_event) + ev->len;
+
+	    if (ev->mask & IN_Q_OVERFLOW)
+	      {
+		_M_overflowp = true;
+		continue;
+	      }
+	    if (ev->mask & IN_IGNORED)
+	      {
+		_M_dirs.erase(ev->wd);
+		continue;
+	      }
+
+	    auto i = _M_dirs.find(ev->wd);
+	    if (i == _M_dirs.end() || ev->len == 0)
+	      continue;
+	    const string path(i->second + k::pathseparator + ev->name);
+	    if (ev->mask & IN_ISDIR)
+	      {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		  add(path, files);
+	      }
+	    else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+	      files.push_back(path);
+	  }
+      }
+    return true;
+  }
+
+private:
+  /// Watch directory @idir and its sub-directories, adding files
+  /// already in them to @files.
+  void
+  add(const string& idir, strings& files)
+  {
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE
+      | IN_ONLYDIR;
+    const int wd = ::inotify_add_watch(_M_fd, idir.c_str(), mask);
+    if (wd < 0)
+      {
+	std::cerr << k::errorprefix << "directory_watch:: cannot watch "
+		  << idir << std::endl;
+	return;
+      }
+    _M_dirs[wd] = idir;
+
+    // Directory may be gone already.
+    std::error_code ec;
+    for (const auto& entry : filesystem::directory_iterator(idir, ec))
+      {
+	if (filesystem::is_directory(entry.status()))
+	  add(entry.path().string(), files);
+	else if (filesystem::is_regular_file(entry.status()))
+	  files.push_back(entry.path().string());
+      }
+  }
+};
+
+} // namespace moz
+#endif
@@ -22,12 +22,21 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <mutex>
+#include <utility>
 #include <vector>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
+#include <string_view>
+#include <charconv>
 #include <experimental/filesystem>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 
 namespace moz::constants {
 
@@ -47,6 +56,10 @@ namespace moz::constants {
   constexpr const char* csv_ext = ".csv";
   constexpr const char* environment_ext = ".environment.json";
   constexpr const char* analyze_ext = ".svg";
+  constexpr const char* analyze_gz_ext = ".svgz";
+
+  // Default quantile for histogram_view_t::quantile.
+  constexpr double quantile_p = 0.95;
 
   // Whitespace constants in pixels.
   constexpr int margin = 100;
@@ -162,7 +175,8 @@ enum class histogram_t
 };
 
 
-/// Compile time switches for histogram extraction.
+/// Compile time switches for histogram extraction. Extraction is a
+/// template on the view, picked once per run by the --view name.
 enum class histogram_view_t
 {
   sum = 0,
@@ -175,7 +189,40 @@ enum class histogram_view_t
 };
 
 
-/// Compile time switches for input data processing.
+/// Names of histogram_view_t views, in enum order.
+constexpr const char* histogram_view_t_names[] =
+{
+  "sum",
+  "median",
+  "mean",
+  "quantile",
+  "range",
+  "stddev",
+  "mdev"
+};
+
+
+string
+to_string(const histogram_view_t view)
+{ return histogram_view_t_names[static_cast<int>(view)]; }
+
+
+/// View named @name, throws if none.
+histogram_view_t
+histogram_view_t_from_name(const string& name)
+{
+  const int n = sizeof(histogram_view_t_names)
+    / sizeof(histogram_view_t_names[0]);
+  for (int i = 0; i < n; ++i)
+    if (name == histogram_view_t_names[i])
+      return static_cast<histogram_view_t>(i);
+  throw std::runtime_error(k::errorprefix + "histogram_view_t_from_name:: "
+			   + "unknown view " + name);
+}
+
+
+/// Input data schemas. Extraction is a template on the schema, so
+/// each has its own code, picked once per input by the --schema name.
 enum class json_t
 {
   browsertime,
@@ -193,6 +240,42 @@ enum class json_t
 };
 
 
+/// Names of json_t schemas, in enum order.
+constexpr const char* json_t_names[] =
+{
+  "browsertime",
+  "browsertime_log",
+  "browsertime_url",
+  "har",
+  "hybrid",
+  "mozilla_desktop",
+  "mozilla_android",
+  "mozilla_snapshot_e",
+  "mozilla_snapshot_h",
+  "mozilla_snapshot_s",
+  "mozilla_glean",
+  "w3c"
+};
+
+
+string
+to_string(const json_t schema)
+{ return json_t_names[static_cast<int>(schema)]; }
+
+
+/// Schema named @name, throws if none.
+json_t
+json_t_from_name(const string& name)
+{
+  const int n = sizeof(json_t_names) / sizeof(json_t_names[0]);
+  for (int i = 0; i < n; ++i)
+    if (name == json_t_names[i])
+      return static_cast<json_t>(i);
+  throw std::runtime_error(k::errorprefix + "json_t_from_name:: "
+			   + "unknown schema " + name);
+}
+
+
 /**
    Environmental Metadata
 
@@ -230,6 +313,100 @@ struct environment
 };
 
 
+/**
+   Input file contents, memory mapped copy-on-write.
+
+   The mapping is always one byte larger than the file and ends in a
+   null byte, so that the contents can be parsed (and modified) in
+   place as a C string. This is done by reserving an anonymous
+   mapping of the total size and then mapping the file over the front
+   of it, as any bytes past the end of the file are zero-filled.
+*/
+struct mapped_file
+{
+  char*		_M_data = nullptr;
+  size_t	_M_size = 0;
+
+  mapped_file() = default;
+
+  explicit
+  mapped_file(const string& ifile)
+  {
+    int fd = ::open(ifile.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0)
+      {
+	if (fd >= 0)
+	  ::close(fd);
+	string m(k::errorprefix + "mapped_file:: cannot open input file: ");
+	m += ifile;
+	throw std::runtime_error(m);
+      }
+    _M_size = st.st_size;
+
+    const int prot = PROT_READ | PROT_WRITE;
+    void* p = ::mmap(nullptr, _M_size + 1, prot,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED && _M_size > 0)
+      {
+	void* pf = ::mmap(p, _M_size, prot, MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (pf == MAP_FAILED)
+	  {
+	    ::munmap(p, _M_size + 1);
+	    p = MAP_FAILED;
+	  }
+	else
+	  ::madvise(p, _M_size, MADV_SEQUENTIAL);
+      }
+    ::close(fd);
+
+    if (p == MAP_FAILED)
+      {
+	string m(k::errorprefix + "mapped_file:: cannot map input file: ");
+	m += ifile;
+	throw std::runtime_error(m);
+      }
+    _M_data = static_cast<char*>(p);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  mapped_file(mapped_file&& other) noexcept
+  : _M_data(other._M_data), _M_size(other._M_size)
+  {
+    other._M_data = nullptr;
+    other._M_size = 0;
+  }
+
+  mapped_file&
+  operator=(mapped_file&& other) noexcept
+  {
+    std::swap(_M_data, other._M_data);
+    std::swap(_M_size, other._M_size);
+    return *this;
+  }
+
+  ~mapped_file()
+  {
+    if (_M_data)
+      ::munmap(_M_data, _M_size + 1);
+  }
+
+  char*
+  data() const
+  { return _M_data; }
+
+  size_t
+  size() const
+  { return _M_size; }
+
+  bool
+  empty() const
+  { return _M_size == 0; }
+};
+
+
 /// Sanity check input file and path exist, and then return stem.
 string
 file_path_to_stem(string ifile)
@@ -240,18 +417,111 @@ file_path_to_stem(string ifile)
       filesystem::path ipath(ifile);
       if (!exists(ipath))
 	throw std::runtime_error("moz::path_to_stem:: could not find " + ifile);
+
+      // Compressed a.json.xz or a.tar.xz is just a.
+      if (ipath.extension() == ".xz")
+	ipath = ipath.stem();
       ret = ipath.stem().string();
     }
   return ret;
 }
 
 
+/// Strip @url into smallest possible value, aka the domain no TLD.
+/// Start with: "https://en.m.wikipedia.org/wiki/Main_Page"
+/// End with: "wikipedia"
+string
+url_to_domain(string url)
+{
+  auto protopos = url.find("://");
+  if (protopos != string::npos)
+    {
+      // Shorten the front, eliminate protocol part of URL string.
+      url = url.substr(protopos + 3);
+
+      // Look for common TLDs.
+      auto tldpos = protopos;
+      auto compos = url.find(".com");
+      if (compos != string::npos)
+	tldpos = compos;
+      else
+	{
+	  auto orgpos = url.find(".org");
+	  if (orgpos != string::npos)
+	    tldpos = orgpos;
+	  else
+	    {
+	      auto netpos = url.find(".net");
+	      if (netpos != string::npos)
+		tldpos = netpos;
+	      else
+		{
+		  string m("url_to_domain:: error, unknown TLD");
+		  m += " in URL string: ";
+		  m += url;
+		  throw std::runtime_error(m);
+		}
+	    }
+	}
+
+      // Assume TLD found. Now, shorten.
+      auto ppos = url.rfind('.', tldpos - 1);
+      if (ppos != string::npos)
+	url = url.substr(ppos + 1, tldpos - ppos - 1);
+      else
+	{
+	  // Assume it's the begining of the string.
+	  url = url.substr(0, tldpos);
+	}
+    }
+  else
+    {
+      string m("url_to_domain:: error, cannot find protocol");
+      m += " in URL string: ";
+      m += url;
+      throw std::runtime_error(m);
+    }
+  return url;
+}
+
+
+/// Output files made by make_data_file on this thread are added to
+/// this list, if set. Used to find the outputs of one extraction.
+strings*&
+data_file_recorder()
+{
+  static thread_local strings* recorder = nullptr;
+  return recorder;
+}
+
+
+/// Record outputs to @ofiles while this is in scope, then put back
+/// the recorder set before. A nested extraction run on this thread,
+/// as by a waiting task, records only its own outputs.
+struct data_file_recording
+{
+  strings*	_M_previous;
+
+  explicit
+  data_file_recording(strings& ofiles)
+  : _M_previous(std::exchange(data_file_recorder(), &ofiles)) { }
+
+  data_file_recording(const data_file_recording&) = delete;
+  data_file_recording& operator=(const data_file_recording&) = delete;
+
+  ~data_file_recording()
+  { data_file_recorder() = _M_previous; }
+};
+
+
 std::ofstream
 make_data_file(const string fstem, const string ext,
 	       const std::ios_base::openmode mode = std::ios_base::out)
 {
   // Prepare output file.
   const string ofile(fstem + ext);
+  if (strings* recorder = data_file_recorder())
+    recorder->push_back(ofile);
   std::ofstream ofs(ofile, mode);
   if (!ofs.good())
     std::cerr << k::errorprefix << "cannot open output file "